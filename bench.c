@@ -0,0 +1,206 @@
+/*
+ * bench.c
+ *
+ * by Stylianos Rousoglou
+ * and Alex Saiontz
+ *
+ * Measures per-request latency of the graph
+ * server over TCP and over a unix domain socket,
+ * issuing requests one at a time per connection
+ * from one or more concurrent client processes
+ */
+
+#include <netdb.h>
+#include <sys/wait.h>
+#include <time.h>
+#include "headers.h"
+
+// Size of buffer holding one response
+#define RESPONSE_SIZE (65536)
+
+// Prints usage message
+static void usage() {
+	fprintf(stderr, "Usage: ./cs426_graph_bench [-n <requests>] [-c <clients>] [-o get_node|add_node] [-t <host:port>] [-u <socket>]\n");
+}
+
+// Returns current time in nanoseconds
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Connects to host:port, returns socket or -1
+static int connect_tcp(const char *address) {
+	char host[256];
+	const char *colon = strrchr(address, ':');
+	if (colon == NULL || colon - address >= (int) sizeof(host)) return -1;
+	memcpy(host, address, colon - address);
+	host[colon - address] = '\0';
+
+	struct addrinfo hints, *res;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, colon + 1, &hints, &res)) return -1;
+
+	int sock = socket(res->ai_family, res->ai_socktype, 0);
+	if (sock != -1 && connect(sock, res->ai_addr, res->ai_addrlen)) {
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(res);
+	return sock;
+}
+
+// Connects to unix domain socket at path, returns socket or -1
+static int connect_unix(const char *path) {
+	struct sockaddr_un addr;
+	if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock != -1 && connect(sock, (struct sockaddr *) &addr, sizeof(addr))) {
+		close(sock);
+		sock = -1;
+	}
+	return sock;
+}
+
+// Sends one request and reads its whole response, returns status code or -1
+static int request(int sock, const char *op, uint64_t id, char *buf) {
+	char body[64];
+	int body_length = sprintf(body, "{\"node_id\":%" PRIu64 "}", id);
+	int length = sprintf(buf, "POST /api/v1/%s HTTP/1.1\r\nContent-Length: %d\r\n\r\n%s", op, body_length, body);
+	if (write(sock, buf, length) != length) return -1;
+
+	// read until headers and Content-Length bytes of body are in
+	int got = 0;
+	char *end = NULL;
+	long content = 0;
+	for (;;) {
+		int n = read(sock, buf + got, RESPONSE_SIZE - 1 - got);
+		if (n <= 0) return -1;
+		got += n;
+		buf[got] = '\0';
+		if (end == NULL && (end = strstr(buf, "\r\n\r\n")) != NULL) {
+			char *cl = strstr(buf, "Content-Length:");
+			if (cl != NULL && cl < end) content = strtol(cl + 15, NULL, 10);
+		}
+		if (end != NULL && got >= end + 4 - buf + content) break;
+	}
+	return (int) strtol(buf + 9, NULL, 10);
+}
+
+// Compares two latencies for qsort
+static int compare(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+// Runs n requests on sock and prints latency statistics under name
+static void run(const char *name, int sock, const char *op, int n, uint64_t first_id) {
+	char *buf = malloc(RESPONSE_SIZE);
+	uint64_t *latency = malloc(sizeof(uint64_t) * n);
+	uint64_t total = 0;
+	int errors = 0;
+
+	for (int i = 0; i < n; i++) {
+		uint64_t start = now_ns();
+		int code = request(sock, op, first_id + i, buf);
+		latency[i] = now_ns() - start;
+		total += latency[i];
+		if (code < 200 || code >= 300) errors++;
+		if (code == -1) {
+			fprintf(stderr, "%s: connection lost after %d requests\n", name, i);
+			n = i;
+			break;
+		}
+	}
+
+	if (n > 0) {
+		qsort(latency, n, sizeof(uint64_t), compare);
+		printf("%-6s %-9s %8d req  mean %8.1f us  p50 %8.1f us  p99 %8.1f us  max %8.1f us  errors %d\n",
+			name, op, n, total / 1000.0 / n, latency[n / 2] / 1000.0,
+			latency[(int) (n * 0.99)] / 1000.0, latency[n - 1] / 1000.0, errors);
+	}
+	free(latency);
+	free(buf);
+}
+
+// Runs clients concurrent clients over one transport and prints their aggregate throughput
+static int run_clients(const char *name, const char *address, bool unix_socket, const char *op,
+		int n, int clients, uint64_t first_id) {
+	uint64_t start = now_ns();
+	for (int i = 0; i < clients; i++) {
+		if (fork() == 0) {
+			int sock = unix_socket ? connect_unix(address) : connect_tcp(address);
+			if (sock == -1) {
+				fprintf(stderr, "Unable to connect to %s\n", address);
+				exit(1);
+			}
+			// each client gets its own id range so mutations never collide
+			run(name, sock, op, n, first_id + (uint64_t) i * n);
+			close(sock);
+			exit(0);
+		}
+	}
+
+	int status, failed = 0;
+	while (wait(&status) > 0) failed |= !WIFEXITED(status) || WEXITSTATUS(status);
+	double seconds = (now_ns() - start) / 1e9;
+	if (clients > 1) {
+		printf("%-6s %-9s %8d req  %d clients  %.0f req/s\n", name, op, n * clients, clients, n * clients / seconds);
+	}
+	return failed;
+}
+
+int main(int argc, char** argv) {
+	int n = 10000;
+	int clients = 1;
+	const char *op = "get_node";
+	const char *tcp = NULL;
+	const char *unix_path = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:c:o:t:u:")) != -1) {
+		switch (opt) {
+			case 'n':
+				n = atoi(optarg);
+				break;
+			case 'c':
+				clients = atoi(optarg);
+				break;
+			case 'o':
+				op = optarg;
+				break;
+			case 't':
+				tcp = optarg;
+				break;
+			case 'u':
+				unix_path = optarg;
+				break;
+			default:
+				usage();
+				return 1;
+		}
+	}
+	if ((tcp == NULL && unix_path == NULL) || n <= 0 || clients <= 0) {
+		usage();
+		return 1;
+	}
+
+	// transports get disjoint id ranges too
+	uint64_t first_id = (uint64_t) time(NULL) << 24;
+	int failed = 0;
+
+	// flush before forking so buffered output is not duplicated
+	fflush(stdout);
+	if (tcp != NULL) failed |= run_clients("tcp", tcp, false, op, n, clients, first_id);
+	fflush(stdout);
+	if (unix_path != NULL) failed |= run_clients("unix", unix_path, true, op, n, clients, first_id + (uint64_t) n * clients);
+	return failed;
+}
@@ -9,19 +9,82 @@
  * startup and format
  */
 
+#define _GNU_SOURCE	// for O_DIRECT
 #include "headers.h"
+#include <pthread.h>
+#include <sys/wait.h>
+#include <time.h>
 
 // Global in-memory variables
 uint32_t generation;  // in-memory generation number
-uint32_t tail;        // in-memory tail of the log
+uint32_t tail;        // in-memory tail of the log, in blocks from log_start
+uint32_t log_start;   // block of the circular log region the log starts at
+char *tail_block;     // resident copy of log entry block tail
+uint64_t tail_xor;    // XOR of all 8-byte words of tail_block after the checksum
+log_entry *staged;    // entries applied in memory but not yet written to the log
+uint32_t n_staged;    // number of staged entries
+uint32_t staged_size; // capacity of staged
+uint64_t staged_total; // entries staged since startup
 
+int durability = DURABILITY_BATCH;	// when log writes are flushed to the device
+double sync_interval = 0.01;	// seconds between flushes under batch durability
+uint64_t sync_bytes = 1 << 20;	// bytes written that force a flush under batch durability
+uint64_t unsynced_bytes;	// bytes written since the last flush
+double last_sync;	// time of the last flush, in seconds
+
+int log_fd;           // device opened for log and superblock I/O, O_DIRECT when possible
+int layout = LAYOUT_V2; // on-disk layout found at startup
+off_t log_base = SUPERBLOCK; // byte offset of log entry block 0
+int replay_mode = REPLAY_SEQUENTIAL; // how get_tail applies the log
+
+double checkpoint_at = 0.75;	// log fill ratio that starts a background checkpoint, 0 for never
+int checkpoint_mode = CHECKPOINT_COPY;	// how the background checkpoint gets its snapshot
+bool checkpointing;	// a checkpoint is being written in the background
+uint64_t checkpoints_started;	// checkpoints started since startup
+uint64_t checkpoints_done;	// checkpoints whose superblock has been written
+uint64_t checkpoint_requests;	// checkpoint requests accepted since startup
+static bool checkpoint_queued;	// a checkpoint was asked for while one was being written
+static bool checkpoint_written;	// set by the checkpoint thread once it is done
+static pthread_t checkpoint_thread;
+static pid_t checkpoint_child;	// process writing the checkpoint, 0 if the thread is
+static checkpoint_area *checkpoint_graph;	// graph the thread writes
+static uint32_t checkpoint_blocks;	// blocks of the log the checkpoint replaces
+static double checkpoint_began;	// time the checkpoint started being written, in seconds
+static uint64_t *checkpoint_written_bytes;	// size the writer reports, in memory shared with a forked one
+static uint32_t checkpoint_retry;	// tail below which no background checkpoint starts after one did not fit
+uint64_t checkpoint_bytes;	// size of the last checkpoint done, 0 if it did not fit
+bool checkpoint_was_delta;	// the last checkpoint done was a delta
+
+int checkpoint_deltas_max = 8;	// deltas written before a full checkpoint is due, 0 for only full ones
+uint32_t checkpoint_deltas;	// deltas on the device after the base checkpoint
+uint32_t checkpoint_slot;	// slot of the checkpoint area holding the base checkpoint
+static uint64_t base_bytes;	// size of the base checkpoint
+static uint64_t deltas_bytes;	// size of all the deltas after it
+static off_t delta_at;	// where the next delta goes in the checkpoint area
+static bool full_due;	// the next checkpoint has to be a full one
+static bool checkpoint_delta;	// the checkpoint running is a delta
+static uint64_t *checkpoint_dirty;	// vertices changed before it started
+static uint64_t checkpoint_n_dirty;
+double checkpoint_seconds;	// time from its snapshot until it was on the device
+
+extern vertex_map map;	// hashtable storing the graph
 extern int fd;
+extern uint64_t log_writes_issued;	// commit writes handed to the log writer
+extern uint64_t log_writes_done;	// commit writes complete with every earlier one
+
+// Opens devfile for log I/O, with O_DIRECT where the filesystem supports it, returns false on failure
+bool open_log(const char *devfile) {
+	log_fd = open(devfile, O_RDWR | O_DIRECT);
+	// e.g. tmpfs refuses O_DIRECT; fall back to the page cache
+	if (log_fd == -1 && errno == EINVAL) log_fd = open(devfile, O_RDWR);
+	return log_fd != -1;
+}
 
 // Returns malloced superblock read from disk
 superblock* get_superblock() {
-	lseek(fd, 0, SEEK_SET);
+	// page aligned, as O_DIRECT needs
 	superblock* new = mmap(NULL, SUPERBLOCK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
-	if (read(fd, new, SUPERBLOCK) != SUPERBLOCK) return NULL;
+	if (pread(log_fd, new, SUPERBLOCK, 0) != SUPERBLOCK) return NULL;
 	// fprintf(stderr, "Reading: generation: %" PRIu32 ", start: %" PRIu32 ", size: %" PRIu32 "\n", new->generation, new->log_start, new->log_size);
 	return new;
 }
@@ -57,17 +120,36 @@ uint64_t checksum_log_entry_block(void *bytes) {
 
 // Writes superblock sup to disk
 size_t write_superblock(superblock* sup) {
-        lseek(fd, 0, SEEK_SET);
         sup->checksum = checksum_superblock(sup);
 
 	// fprintf(stderr, "Writing Superblock: generation: %" PRIu32 ", start: %" PRIu32 ", size: %" PRIu32 "\n", sup->generation, sup->log_start, sup->log_size);
 
-	return write(fd, sup, SUPERBLOCK);
+	return pwrite(log_fd, sup, SUPERBLOCK, 0);
 }
 
-// Returns true if checksum is equal to the XOR of all 8-byte words in superblock
+// Returns true if block is a v2 superblock and checksum is equal to the XOR of all its 8-byte words
 bool valid_superblock(superblock *block, uint64_t checksum) {
-	return checksum == checksum_superblock(block);
+	return block->magic == SUPERBLOCK_MAGIC && block->version == LAYOUT_V2 && checksum == checksum_superblock(block);
+}
+
+// Returns true if checksum matches block read as a v1 superblock
+bool valid_superblock_v1(superblock *block, uint64_t checksum) {
+	// v1 only covered the single whole word after the checksum
+	uint64_t word;
+	memcpy(&word, (char *) block + 8, 8);
+	return checksum == word + 3;
+}
+
+// Turns sup into an empty v2 superblock of generation gen
+static void fill_superblock(superblock *sup, uint32_t gen) {
+	memset(sup, 0, SUPERBLOCK);
+	sup->generation = gen;
+	sup->log_start = 1;
+	sup->log_size = LOG_SIZE;
+	sup->version = LAYOUT_V2;
+	sup->magic = SUPERBLOCK_MAGIC;
+	layout = LAYOUT_V2;
+	log_base = SUPERBLOCK;
 }
 
 // Returns true if checksum is equal to the XOR of all 8-byte words in log entry block
@@ -80,32 +162,39 @@ bool format_superblock() {
 	superblock* sup = get_superblock();
 	if (sup == NULL) return false;
 
-	if (valid_superblock(sup, sup->checksum)) {
-		sup->generation = sup->generation + 1;
+	// formatting always writes the v2 layout
+	if (valid_superblock(sup, sup->checksum) || valid_superblock_v1(sup, sup->checksum)) {
+		// a background checkpoint cut short may have left blocks of the next generation behind
+		fill_superblock(sup, sup->generation + 2);
 		// fprintf(stderr, "Superblock was valid. Incremented to %d\n", (int) sup->generation);
 	} else {
-		sup->generation = 0;
-		sup->log_start = 1;
-		sup->log_size = LOG_SIZE; // unsure if this is meant to be 2GB always but that's what he said in class
+		fill_superblock(sup, 0);
 		// fprintf(stderr, "Superblock was invalid. Initialized to 0\n");
 	}
 	generation = sup->generation;
 	tail = 0;
+	log_start = 0;
+	checkpoint_deltas = 0;
+	checkpoint_slot = 0;
+	reset_tail_block();
 	if (write_superblock(sup) != SUPERBLOCK) return false;
 	return true;
 }
 
-// Writes superblock with incremented generation number upon chckpoint
-bool update_superblock() {
+// Writes superblock for the log of the current generation, starting at block start
+bool update_superblock(uint32_t start) {
 	superblock* sup = get_superblock();
         if (sup == NULL) return false;
 
-	sup->generation = sup->generation + 1;
-	generation++;
+	// a v1 superblock is rewritten as v2: the new generation's log continues at the v2 offset
+	fill_superblock(sup, generation);
+	sup->log_start = 1 + start;
+	sup->checkpoint_deltas = checkpoint_deltas;
+	sup->checkpoint_slot = checkpoint_slot;
 	// fprintf(stderr, "Generation incremented to %d\n", (int) sup->generation);
-	tail = 0;
-	if (write_superblock(sup) != SUPERBLOCK) return false;
-	return true;
+	bool ok = write_superblock(sup) == SUPERBLOCK;
+	munmap(sup, SUPERBLOCK);
+	return ok;
 }
 
 // Reads the superblock, checks if it is valid, and returns true upon success
@@ -115,206 +204,898 @@ bool normal_startup() {
 
 	if (valid_superblock(sup, sup->checksum)) {
 		generation = sup->generation;
+		log_start = (sup->log_start - 1) % MAX_BLOCKS;
+		checkpoint_deltas = sup->checkpoint_deltas;
+		checkpoint_slot = sup->checkpoint_slot == 1;
 		// fprintf(stderr, "Superblock was valid. Normal startup\n");
 		return true;
+	} else if (valid_superblock_v1(sup, sup->checksum)) {
+		// replay the unaligned log; the caller migrates with a checkpoint
+		generation = sup->generation;
+		log_start = 0;
+		layout = LAYOUT_V1;
+		log_base = SUPERBLOCK_V1;
+		return true;
 	} else {
 		// fprintf(stderr, "Superblock was invalid. Abort\n");
 		return false;
 	}
 }
 
-// Returns number of log entry block that should be written next
+// Returns number of log entry block that should be written next, counted from log_start
 uint32_t get_tail() {
-	uint32_t runner = -1;
-	log_entry_block_header *new = mmap(NULL, LOG_ENTRY_HEADER, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+	uint32_t runner;
 	char *block = mmap(NULL, LOG_ENTRY_BLOCK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
 
-	bool valid, full, gen, end;
-	// move to end of superblock
-	lseek(fd, SUPERBLOCK, SEEK_SET);
-	do {
-		// first time through, defaults to 0
-		runner += 1;
-
-		// read entire 4KB block in
-
-		if (read(fd, block, LOG_ENTRY_BLOCK) != LOG_ENTRY_BLOCK) exit(2);
-		// extract log entry block header
-		memcpy(new, block, LOG_ENTRY_HEADER);
+	bool valid = false;
+	bool open = false;	// last block applied was partly filled
+	// the v1 log is not sector aligned, so O_DIRECT cannot read it
+	int in = (layout == LAYOUT_V1) ? fd : log_fd;
+	struct timespec start, stop;
+	uint64_t replayed = 0;
+	uint32_t blocks_read = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	log_reader_start(in, log_base, log_start, MAX_BLOCKS, generation);
+	for (runner = 0; runner < MAX_BLOCKS; runner++) {
+		// take entire 4KB block from the chunks read ahead, already verified and decoded
+		log_entry *entries;
+		char *next = log_reader_next(&valid, &entries);
+		if (next == NULL) break;
+		blocks_read++;
+		log_entry_block_header *header = (log_entry_block_header *) next;
 
-		valid = valid_log_entry_block(block, new->checksum);
-		full = new->n_entries == N_ENTRIES;
-		gen = new->generation == generation;
-		end = runner < MAX_BLOCKS - 1;
+		// a checkpoint cut short leaves the log going on in the next generation, possibly after a partly
+		// filled block; otherwise the log ends at a block that is invalid, stale, or follows a partial one
+		if (valid && header->generation == generation + 1) generation++;
+		else if (!valid || header->generation != generation || open) break;
 
-		if (valid && gen) {
-			//TODO: somewhere here play the log forward?
-			play_log_forward(block, new->n_entries);
+		memcpy(block, next, LOG_ENTRY_BLOCK);
+		for (uint32_t i = 0; i < header->n_entries; i++) {
+			if (replay_mode == REPLAY_COMPACT) compact_log_entry(&entries[i]);
+			else apply_log_entry(&entries[i]);
 		}
+		replayed += header->n_entries;
+		open = header->n_entries != N_ENTRIES;
+	}
+	log_reader_stop();
+	if (replay_mode == REPLAY_COMPACT) {
+		fprintf(stderr, "Compacted %" PRIu64 " log entries to %" PRIu64 " operations\n", replayed, compact_apply());
+	}
 
-	} while(valid && full && gen && end);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	double seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+	double mb = blocks_read * (double) LOG_ENTRY_BLOCK / (1 << 20);
+	fprintf(stderr, "Replayed %" PRIu64 " log entries (%.1f MB) in %.3f s: %.0f MB/s, %.0f entries/s\n",
+		replayed, mb, seconds, mb / seconds, replayed / seconds);
 
-	//TODO: if wrong generation, write size to be 0 (to make checksum fail)
-	if (!gen) {
-		// fprintf(stderr, "Tail stopped at wrong generation, read %d!\n", (int) new->generation);
-		lseek(fd, -LOG_ENTRY_BLOCK, SEEK_CUR);
-		new->n_entries = 697;
-		if (write(fd, new, LOG_ENTRY_HEADER) != LOG_ENTRY_HEADER) exit(2);
-	}
-	if (!valid) fprintf(stderr, "Tail stopped at invalid log block!\n");
+	if (!valid && !open && runner < MAX_BLOCKS) fprintf(stderr, "Tail stopped at invalid log block!\n");
 
-	if (runner == MAX_BLOCKS - 1 && new->n_entries == N_ENTRIES) runner = MAX_BLOCKS;
+	// keep the partially filled tail block resident for appends
+	if (open) {
+		runner--;
+		load_tail_block(block);
+	} else {
+		reset_tail_block();
+	}
+	munmap(block, LOG_ENTRY_BLOCK);
         
 	// fprintf(stderr, "Tail was set to %" PRIu32 "\n", runner);
-	// fprintf(stderr, "Number of entries in current block is %" PRIu32 "\n", new->n_entries);
 	return runner;
 }
 
-// Appends most recent mutating command to log, returns true on success
+// XORs into sum the 8-byte words of the tail block overlapping bytes [start, end)
+static void xor_words(uint64_t *sum, int start, int end) {
+	uint64_t *words = (uint64_t *) tail_block;
+	for (int i = start / 8; i < (end + 7) / 8; i++) *sum ^= words[i];
+}
+
+// Allocates the resident tail block on first use
+static void alloc_tail_block() {
+	if (tail_block == NULL && posix_memalign((void **) &tail_block, LOG_ENTRY_BLOCK, LOG_ENTRY_BLOCK)) exit(1);
+}
+
+// Starts an empty tail block of the current generation
+void reset_tail_block() {
+	alloc_tail_block();
+	log_entry_block_header header = { 0, generation, 0 };
+	memset(tail_block, 0, LOG_ENTRY_BLOCK);
+	memcpy(tail_block, &header, LOG_ENTRY_HEADER);
+	tail_xor = 0;
+	xor_words(&tail_xor, 8, LOG_ENTRY_BLOCK);
+	((log_entry_block_header *) tail_block)->checksum = tail_xor + 3;
+}
+
+// Makes block, read from the log at tail, the resident tail block if it belongs to this generation
+void load_tail_block(char *block) {
+	log_entry_block_header *header = (log_entry_block_header *) block;
+	alloc_tail_block();
+	if (!valid_log_entry_block(block, header->checksum) || header->generation != generation) {
+		reset_tail_block();
+		return;
+	}
+	memcpy(tail_block, block, LOG_ENTRY_BLOCK);
+	tail_xor = header->checksum - 3;
+}
+
+// Adds entry to the resident tail block, keeping its checksum up to date
+static void append_to_tail_block(log_entry *entry) {
+	log_entry_block_header *header = (log_entry_block_header *) tail_block;
+	int start = LOG_ENTRY_HEADER + header->n_entries * LOG_ENTRY;
+
+	// the word holding n_entries and the words the entry lands on change
+	xor_words(&tail_xor, 8, 16);
+	xor_words(&tail_xor, start, start + LOG_ENTRY);
+	memcpy(tail_block + start, entry, LOG_ENTRY);
+	header->n_entries++;
+	xor_words(&tail_xor, 8, 16);
+	xor_words(&tail_xor, start, start + LOG_ENTRY);
+	header->checksum = tail_xor + 3;
+}
+
+// Returns number of 20B entries that still fit in the log segment, counting staged ones as used
+uint64_t log_room() {
+	if (tail >= MAX_BLOCKS) return 0;
+	return (uint64_t) (MAX_BLOCKS - tail) * N_ENTRIES - ((log_entry_block_header *) tail_block)->n_entries - n_staged;
+}
+
+// Stages n entries for the next group commit, returns false if the log cannot take them
+bool stage_log_entries(log_entry *entries, uint32_t n) {
+	if (log_room() < n) return false;
+	if (n_staged + n > staged_size) {
+		staged_size = (n_staged + n) * 2;
+		staged = realloc(staged, sizeof(log_entry) * staged_size);
+		if (!staged) exit(1);
+	}
+	memcpy(staged + n_staged, entries, sizeof(log_entry) * n);
+	n_staged += n;
+	staged_total += n;
+	return true;
+}
+
+// Stages most recent mutating command for the next group commit, returns true on success
 bool add_to_log(uint32_t opcode, uint64_t arg1, uint64_t arg2) {
-	// if log full
-        if (tail == MAX_BLOCKS) {
-		// fprintf(stderr, "Log segment is FULL!\n");
-		return false;
-        } else {
-		log_entry *entry = mmap(NULL, LOG_ENTRY, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
-		log_entry_block_header *header = mmap(NULL, LOG_ENTRY_HEADER, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
-		char *block = mmap(NULL, LOG_ENTRY_BLOCK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
-
-		entry->opcode = opcode;
-		entry->node_a_id = arg1;
-		entry->node_b_id = arg2;
-
-		// go to correct block
-		lseek(fd, SUPERBLOCK + tail * LOG_ENTRY_BLOCK, SEEK_SET);
-		fprintf(stderr, "Read %d block at position %d\n", (int) read(fd, block, LOG_ENTRY_BLOCK), tail);
-		// extract log entry block header
-
-		memcpy(header, block, LOG_ENTRY_HEADER);
-		lseek(fd, SUPERBLOCK + tail * LOG_ENTRY_BLOCK, SEEK_SET);
-		// if block invalid, write size to be 1 and then the newly added entry
-		if (!valid_log_entry_block(block, header->checksum) || header->generation != generation) {
-			header->generation = generation;
-			header->n_entries = 1;
-			if (write(fd, header, LOG_ENTRY_HEADER) != LOG_ENTRY_HEADER) exit(2);
-		} else {
-			header->n_entries = header->n_entries + 1;
-			if (write(fd, header, LOG_ENTRY_HEADER) != LOG_ENTRY_HEADER) exit(2);
-			if (write(fd, block + LOG_ENTRY_HEADER, LOG_ENTRY * (header->n_entries - 1)) != LOG_ENTRY * (header->n_entries - 1)) exit(2);
+	log_entry entry;
+	entry.opcode = opcode;
+	entry.node_a_id = arg1;
+	entry.node_b_id = arg2;
+	return stage_log_entries(&entry, 1);
+}
+
+// Appends n entries to the log with a single contiguous write handed to the log writer
+static void write_log_entries(log_entry *entries, uint32_t n) {
+	uint32_t at = (log_start + tail) % MAX_BLOCKS;
+	off_t offset = log_base + (off_t) at * LOG_ENTRY_BLOCK;
+	uint32_t used = ((log_entry_block_header *) tail_block)->n_entries;
+	uint64_t nblocks = ((uint64_t) used + n + N_ENTRIES - 1) / N_ENTRIES;
+	char *buf;
+	if (posix_memalign((void **) &buf, LOG_ENTRY_BLOCK, nblocks * LOG_ENTRY_BLOCK)) exit(1);
+
+	// fill the resident block and copy it out each time it is full
+	uint64_t b = 0;
+	for (uint32_t i = 0; i < n; i++) {
+		append_to_tail_block(&entries[i]);
+		if (((log_entry_block_header *) tail_block)->n_entries == N_ENTRIES) {
+			memcpy(buf + b++ * LOG_ENTRY_BLOCK, tail_block, LOG_ENTRY_BLOCK);
+			tail++;
+			reset_tail_block();
 		}
-		if (write(fd, entry, LOG_ENTRY) != LOG_ENTRY) exit(2);
-		lseek(fd, SUPERBLOCK + tail * LOG_ENTRY_BLOCK, SEEK_SET);
-		if (read(fd, block, LOG_ENTRY_BLOCK) != LOG_ENTRY_BLOCK) exit(2);
-		header->checksum = checksum_log_entry_block(block);
-		lseek(fd, SUPERBLOCK + tail * LOG_ENTRY_BLOCK, SEEK_SET);
-		if (write(fd, header, LOG_ENTRY_HEADER) != LOG_ENTRY_HEADER) exit(2);
-
-		// when block MAX_BLOCKS is full, tail++ = s MAX_BLOCKS and additional logging allowed (first line in function)
-		if (header->n_entries == N_ENTRIES) tail++;
-	}
-	// 3 cases: fits in tail, need to move tail to next block, or out of space!
-        return true;
-}
-
-// Plays forward all 20B entries present in block
-void play_log_forward(char *block, uint32_t entries) {
-        char *tmp = block + LOG_ENTRY_HEADER;
-        log_entry *new = mmap(NULL, LOG_ENTRY, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
-        for (uint32_t i = 0; i < entries; i++) {
-                memcpy(new, tmp + i * LOG_ENTRY, LOG_ENTRY);
-                switch(new->opcode) {
-                        case ADD_NODE:
-                                add_vertex(new->node_a_id);
-                                break;
-                        case ADD_EDGE:
-                                add_edge(new->node_a_id, new->node_b_id);
-                                break;
-                        case REMOVE_NODE:
-                                remove_vertex(new->node_a_id);
-                                break;
-                        case REMOVE_EDGE:
-                                remove_edge(new->node_a_id, new->node_b_id);
-               			break;
-		 }
-	// fprintf(stderr, "op: %" PRIu32 ",node a: %" PRIu64 ", node b (only for 1 and 3): %" PRIu64 "\n", new->opcode, new->node_a_id, new->node_b_id);
-        }
-}
-
-checkpoint_area *get_checkpoint(int fd){
-	lseek(fd, LOG_SIZE, SEEK_SET);
-	int cpsize=0;
-	uint64_t nsize;
-	uint64_t esize;
+	}
+	if (b < nblocks) memcpy(buf + b * LOG_ENTRY_BLOCK, tail_block, LOG_ENTRY_BLOCK);
+
+	// blocks past the end of the region wrap around to its start; they are written here, before the
+	// rest, so the one write the commit hands over covers them too (this happens once per lap)
+	uint64_t first = nblocks;
+	if (at + nblocks > MAX_BLOCKS) {
+		first = MAX_BLOCKS - at;
+		size_t rest = (nblocks - first) * LOG_ENTRY_BLOCK;
+		if (pwrite(log_fd, buf + first * LOG_ENTRY_BLOCK, rest, log_base) != rest) exit(2);
+	}
+
+	// strict durability flushes before anyone is acknowledged
+	log_writer_submit(buf, first * LOG_ENTRY_BLOCK, offset, durability == DURABILITY_STRICT, used > 0);
+}
+
+// Flushes everything written to the device so far; writes still in flight are not covered
+void sync_log() {
+	// covers the checkpoint too: both descriptors refer to the same device
+	if (fdatasync(log_fd)) exit(2);
+	unsynced_bytes = 0;
+}
+
+// Flushes the log if the batch durability window has passed, now in seconds
+void sync_log_if_due(double now) {
+	if (durability != DURABILITY_BATCH || unsynced_bytes == 0) {
+		last_sync = now;
+		return;
+	}
+	// a flush would miss writes still in flight, so it waits for them to land
+	if (log_writes_done < log_writes_issued) return;
+	if (now - last_sync >= sync_interval || unsynced_bytes >= sync_bytes) {
+		sync_log();
+		last_sync = now;
+	}
+}
+
+// Writes every staged entry to the log at once
+void commit_log() {
+	if (n_staged == 0) return;
+	uint32_t used = ((log_entry_block_header *) tail_block)->n_entries;
+	write_log_entries(staged, n_staged);
+	if (durability != DURABILITY_STRICT) {
+		unsynced_bytes += ((uint64_t) used + n_staged + N_ENTRIES - 1) / N_ENTRIES * LOG_ENTRY_BLOCK;
+	}
+	n_staged = 0;
+}
+
+// Applies a mutating log entry to the in-memory graph, returns 200, 204 or 400
+int apply_log_entry(log_entry *entry) {
+	switch(entry->opcode) {
+		case ADD_NODE:
+			return add_vertex(entry->node_a_id) ? 200 : 204;
+		case ADD_EDGE:
+			return add_edge(entry->node_a_id, entry->node_b_id);
+		case REMOVE_NODE:
+			return remove_vertex(entry->node_a_id) ? 200 : 400;
+		case REMOVE_EDGE:
+			return remove_edge(entry->node_a_id, entry->node_b_id) ? 200 : 400;
+	}
+	return 400;
+}
+
+// Returns the size on disk of a checkpoint of version with nsize nodes and esize edges
+uint64_t checkpoint_size(int version, uint64_t nsize, uint64_t esize){
+	if (version == CHECKPOINT_V1) return CHECKPOINT_HEADER + nsize * CHECKPOINT_NODE + esize * CHECKPOINT_EDGE;
+	if (version == CHECKPOINT_V3 || version == CHECKPOINT_V4) {
+		// every node takes at least a byte for its id and one for its degree, every neighbor one
+		uint64_t nblocks = (nsize + CHECKPOINT_BLOCK_NODES - 1) / CHECKPOINT_BLOCK_NODES;
+		uint64_t entry = version == CHECKPOINT_V3 ? CHECKPOINT_INDEX : CHECKPOINT_INDEX_V4;
+		return CHECKPOINT_HEADER_V3 + (nblocks + 1) * entry + 2 * nsize + 2 * esize;
+	}
+	return CHECKPOINT_HEADER_V2 + nsize * CHECKPOINT_NODE + (nsize + 1) * CHECKPOINT_OFFSET + 2 * esize * CHECKPOINT_NEIGHBOR;
+}
+
+// One thread's share of checkpoint work
+typedef struct worker_arg {
+	void (*work)(int, int);
 	int i;
-	if (read(fd, &(nsize), 8) != 8) {
+	int n;
+} worker_arg;
+
+// Runs one share of checkpoint work
+static void* run_worker(void *arg) {
+	worker_arg *w = arg;
+	w->work(w->i, w->n);
+	return NULL;
+}
+
+// Returns the number of threads checkpoint work is split across: one per core, at most CHECKPOINT_WORKERS
+int checkpoint_workers() {
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	return cores > CHECKPOINT_WORKERS ? CHECKPOINT_WORKERS : (cores > 1 ? cores : 1);
+}
+
+// Runs work(i, n) for every i below n, each on a thread of its own but the first, and waits for them all
+void run_workers(void (*work)(int, int), int n) {
+	pthread_t threads[CHECKPOINT_WORKERS];
+	worker_arg args[CHECKPOINT_WORKERS];
+	for (int i = 0; i < n; i++) args[i] = (worker_arg) { work, i, n };
+	for (int i = 1; i < n; i++) {
+		if (pthread_create(&threads[i], NULL, run_worker, &args[i])) exit(1);
+	}
+	run_worker(&args[0]);
+	for (int i = 1; i < n; i++) pthread_join(threads[i], NULL);
+}
+
+// Returns the bytes v takes as a varint: 7 bits a byte, low bits first, the top bit set on all but the last
+static int varint_size(uint64_t v) {
+	int n = 1;
+	for (; v >= 0x80; v >>= 7) n++;
+	return n;
+}
+
+// Decodes the varint at p into v, returns the byte after it, or NULL if it runs past end
+static const unsigned char* get_varint(const unsigned char *p, const unsigned char *end, uint64_t *v) {
+	uint64_t value = 0;
+	for (int shift = 0; p < end && shift < 64; shift += 7) {
+		uint64_t byte = *p++;
+		value |= (byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			*v = value;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+// Returns the distance from node id to neighbor, zigzagged so small distances either way stay small
+static uint64_t zigzag(uint64_t id, uint64_t neighbor) {
+	int64_t d = (int64_t) (neighbor - id);
+	return ((uint64_t) d << 1) ^ (uint64_t) (d >> 63);
+}
+
+// Returns the neighbor zigzag put at distance z from node id
+static uint64_t unzigzag(uint64_t id, uint64_t z) {
+	return id + ((z >> 1) ^ -(z & 1));
+}
+
+static uint32_t crc32c_table[256];	// CRC32C of each byte, for CPUs without the instruction
+static uint32_t (*crc32c_run)(uint32_t, const unsigned char *, size_t);	// one of the two below
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+// Returns crc, as the CRC32C of some data, extended over length bytes at p a byte at a time
+static uint32_t crc32c_bytes(uint32_t crc, const unsigned char *p, size_t length) {
+	crc = ~crc;
+	for (; length > 0; p++, length--) crc = crc32c_table[(crc ^ *p) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+#if defined(__x86_64__)
+// Returns crc extended over length bytes at p with the SSE4.2 crc32 instruction, 8 bytes at a time
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t length) {
+	uint64_t c = ~crc;
+	for (; length >= 8; p += 8, length -= 8) {
+		uint64_t word;
+		memcpy(&word, p, 8);
+		c = __builtin_ia32_crc32di(c, word);
+	}
+	uint32_t c32 = c;
+	for (; length > 0; p++, length--) c32 = __builtin_ia32_crc32qi(c32, *p);
+	return ~c32;
+}
+#endif
+
+// Fills the byte table and picks the instruction where the CPU has it
+static void crc32c_init() {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++) c = (c >> 1) ^ (0x82f63b78 & -(c & 1));
+		crc32c_table[i] = c;
+	}
+	crc32c_run = crc32c_bytes;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2")) crc32c_run = crc32c_sse42;
+#endif
+}
+
+// Returns crc, as the CRC32C of some data, extended over length bytes of data; start from 0
+static uint32_t crc32c(uint32_t crc, const void *data, size_t length) {
+	pthread_once(&crc32c_once, crc32c_init);
+	return crc32c_run(crc, data, length);
+}
+
+// v3 or v4 checkpoint being decoded by the loader threads
+static struct {
+	checkpoint_area *graph;
+	const unsigned char *data;	// start of the block data
+	const uint64_t *index;
+	int entry;	// words per index entry, 3 if they hold checksums
+	uint64_t nblocks;
+	uint64_t next;	// next block to claim
+	bool failed;
+} decoding;
+
+// Returns true if the bytes from p to end are all zero
+static bool zero_bytes(const unsigned char *p, const unsigned char *end) {
+	for (; p < end; p++) if (*p) return false;
+	return true;
+}
+
+// Decodes block b of the checkpoint being loaded into its arrays, returns false if it is corrupt
+static bool decode_block(uint64_t b) {
+	checkpoint_area *g = decoding.graph;
+	const uint64_t *entry = decoding.index + decoding.entry * b;
+	const unsigned char *p = decoding.data + entry[0];
+	const unsigned char *end = decoding.data + entry[decoding.entry];
+	uint64_t k = entry[1];
+	uint64_t last = entry[decoding.entry + 1];
+	// each thread checks the blocks it decodes, while they are in its cache
+	if (decoding.entry == 3 && crc32c(0, p, end - p) != entry[2]) return false;
+	uint64_t first = b * CHECKPOINT_BLOCK_NODES;
+	uint64_t stop = g->nsize - first < CHECKPOINT_BLOCK_NODES ? g->nsize : first + CHECKPOINT_BLOCK_NODES;
+	uint64_t id = 0, v, degree;
+
+	for (uint64_t i = first; i < stop; i++) {
+		if (!(p = get_varint(p, end, &v))) return false;
+		id += v;
+		g->nodes[i] = id;
+		g->offsets[i] = k;
+		if (!(p = get_varint(p, end, &degree)) || degree > last - k) return false;
+		uint64_t neighbor = id;
+		for (uint64_t d = 0; d < degree; d++) {
+			if (!(p = get_varint(p, end, &v))) return false;
+			neighbor = d == 0 ? unzigzag(id, v) : neighbor + v;
+			g->neighbors[k++] = neighbor;
+		}
+	}
+	// a block uses up exactly its neighbors and its bytes, but for the padding that ends a writer's share
+	return k == last && zero_bytes(p, end);
+}
+
+// Decodes blocks until none are left unclaimed
+static void decode_blocks(int i, int n) {
+	uint64_t b;
+	while ((b = __atomic_fetch_add(&decoding.next, 1, __ATOMIC_RELAXED)) < decoding.nblocks) {
+		if (!decode_block(b)) __atomic_store_n(&decoding.failed, true, __ATOMIC_RELAXED);
+	}
+}
+
+// Returns the image at byte at of the checkpoint area on fd, made of head bytes and then an index of
+// entry bytes per block and v3 blocks of nsize nodes and n_neighbors neighbors, decoded into v2 arrays,
+// or NULL if it is corrupt or, with v4 entries, fails a checksum
+static checkpoint_area* load_blocks(int fd, off_t at, uint64_t head, uint64_t entry, uint64_t nsize, uint64_t n_neighbors,
+		uint64_t nblocks, int version) {
+	if (nblocks != (nsize + CHECKPOINT_BLOCK_NODES - 1) / CHECKPOINT_BLOCK_NODES || nblocks > CHECKPOINT_AREA / entry
+			|| head > CHECKPOINT_AREA) {
 		return NULL;
 	}
-	if (read(fd, &(esize), 8) != 8) {
+	// the entry past the last block holds the size of the data and the number of neighbors
+	uint64_t last[3];
+	uint64_t data = head + (nblocks + 1) * entry;
+	if (at + data > CHECKPOINT_AREA || pread(fd, last, entry, LOG_SIZE + at + data - entry) != entry) {
 		return NULL;
 	}
-	lseek(fd, LOG_SIZE, SEEK_SET);
-	cpsize = CHECKPOINT_HEADER + nsize*CHECKPOINT_NODE 
-		+ esize*CHECKPOINT_EDGE;
-
-	uint64_t *nodes;
-	mem_edge *edges;
-	checkpoint_area *new = malloc(sizeof(struct checkpoint_area));
-	if (nsize >= 0) {nodes = malloc(sizeof(uint64_t) * nsize);}
-	if (esize >= 0) {edges = malloc(sizeof(struct mem_edge) * esize);}
-	if (read(fd, &(new->nsize), 8) != 8) return NULL;
-	if (read(fd, &(new->esize), 8) != 8) return NULL;
-		
-	for (i=0; i< new->nsize; i++){
-		if (read(fd, &(nodes[i]), CHECKPOINT_NODE) 
-			!= CHECKPOINT_NODE) {
-			return NULL;
-		}
+	off_t end = lseek(fd, 0, SEEK_END);
+	// every node takes at least two bytes and every neighbor one
+	if (last[0] > CHECKPOINT_AREA || last[1] != n_neighbors || at + data + last[0] > CHECKPOINT_AREA
+			|| 2 * nsize + n_neighbors > last[0] || end < 0 || end < LOG_SIZE + at + data + last[0]) {
+		return NULL;
 	}
-	
-	for (i=0; i < new->esize; i++){
-		if (read(fd, &(edges[i].a), CHECKPOINT_NODE)  
-			!= CHECKPOINT_NODE) {
-			return NULL;
-		} 
-		if (read(fd, &(edges[i].b), CHECKPOINT_NODE)  
-			!= CHECKPOINT_NODE) {
-			return NULL;
-		} 
+	uint64_t cpsize = data + last[0];
+	char *area = mmap(NULL, cpsize, PROT_READ, MAP_SHARED, fd, LOG_SIZE + at);
+	if (area == MAP_FAILED) return NULL;
+	madvise(area, cpsize, MADV_WILLNEED);
+
+	// blocks have to follow each other, or decoding them would write out of bounds; the data may
+	// start with padding up to a whole block
+	const uint64_t *index = (const uint64_t *) (area + head);
+	int words = entry / sizeof(uint64_t);
+	bool ok = index[1] == 0;
+	if (words == 3) ok = ok && crc32c(0, area, data - sizeof(uint64_t)) == last[2];
+	for (uint64_t b = 0; ok && b < nblocks; b++) {
+		ok = index[words * b] <= index[words * (b + 1)] && index[words * b + 1] <= index[words * (b + 1) + 1];
 	}
-	new->nodes=nodes;
-	new->edges=edges;
+	ok = ok && zero_bytes((const unsigned char *) area + data, (const unsigned char *) area + data + index[0]);
 
+	checkpoint_area *new = calloc(1, sizeof(struct checkpoint_area));
+	new->version = version;
+	new->bytes = cpsize;
+	new->nsize = nsize;
+	new->nodes = malloc(sizeof(uint64_t) * nsize);
+	new->offsets = malloc(sizeof(uint64_t) * (nsize + 1));
+	new->neighbors = malloc(sizeof(uint64_t) * n_neighbors);
+	if (!new->nodes || !new->offsets || (n_neighbors && !new->neighbors)) ok = false;
+
+	if (ok) {
+		decoding.graph = new;
+		decoding.data = (const unsigned char *) area + data;
+		decoding.index = index;
+		decoding.entry = words;
+		decoding.nblocks = nblocks;
+		decoding.next = 0;
+		decoding.failed = false;
+		run_workers(decode_blocks, checkpoint_workers());
+		new->offsets[nsize] = n_neighbors;
+		ok = !decoding.failed;
+	}
+	munmap(area, cpsize);
+	if (!ok) {
+		put_checkpoint(new);
+		return NULL;
+	}
 	return new;
 }
 
-int write_cp(int fd, checkpoint_area *new){
-	lseek(fd, LOG_SIZE, SEEK_SET);
+// Returns the v3 or v4 checkpoint at byte at of the checkpoint area on fd with the given header decoded
+// into v2 arrays, or NULL if it is corrupt
+static checkpoint_area* load_v3(int fd, off_t at, uint64_t *header, int version) {
+	if (header[2] > CHECKPOINT_AREA) return NULL;
+	uint64_t entry = version == CHECKPOINT_V3 ? CHECKPOINT_INDEX : CHECKPOINT_INDEX_V4;
+	checkpoint_area *new = load_blocks(fd, at, CHECKPOINT_HEADER_V3, entry, header[1], 2 * header[2], header[3], version);
+	if (new) new->esize = header[2];
+	return new;
+}
 
-	// add debug line
-	int i;
-	if (write(fd, &(new->nsize), 8) != 8) return 0;
-	
-	
-	if (write(fd, &(new->esize), 8) != 8) return 0;
-	
-	for (i=0; i< new->nsize; i++){
-		if (write(fd, &((new->nodes)[i]), CHECKPOINT_NODE) 
-			!= CHECKPOINT_NODE) {
-			return 0;
-		} 
-	}
-	
-	for (i=0; i < new->esize; i++){
-		if (write(fd, &(((new->edges)[i]).a), CHECKPOINT_NODE)  
-			!= CHECKPOINT_NODE) {
-			return 0;
-		} 
-		if (write(fd, &(((new->edges)[i]).b), CHECKPOINT_NODE)  
-			!= CHECKPOINT_NODE) {
-			return 0;
-		} 
-	}
-	return 5;
+// Returns delta number seq, at byte at of the checkpoint area on fd, decoded, or NULL if it is not there
+static checkpoint_area* load_delta(int fd, off_t at, uint64_t seq) {
+	uint64_t header[6];	// magic, seq, nsize, neighbors, blocks, removed
+	if (at + CHECKPOINT_HEADER_DELTA > CHECKPOINT_AREA
+			|| pread(fd, header, CHECKPOINT_HEADER_DELTA, LOG_SIZE + at) != CHECKPOINT_HEADER_DELTA) {
+		return NULL;
+	}
+	if ((header[0] != CHECKPOINT_MAGIC_DELTA && header[0] != CHECKPOINT_MAGIC_DELTA_V4) || header[1] != seq
+			|| header[3] > CHECKPOINT_AREA || header[5] > CHECKPOINT_AREA / CHECKPOINT_NODE) {
+		return NULL;
+	}
+	uint64_t head = CHECKPOINT_HEADER_DELTA + header[5] * CHECKPOINT_NODE;
+	uint64_t entry = header[0] == CHECKPOINT_MAGIC_DELTA ? CHECKPOINT_INDEX : CHECKPOINT_INDEX_V4;
+	checkpoint_area *delta = load_blocks(fd, at, head, entry, header[2], header[3], header[4], CHECKPOINT_DELTA);
+	if (delta == NULL) return NULL;
+	delta->n_removed = header[5];
+	delta->removed = malloc(header[5] * CHECKPOINT_NODE);
+	if ((header[5] && !delta->removed) || pread(fd, delta->removed, header[5] * CHECKPOINT_NODE,
+			LOG_SIZE + at + CHECKPOINT_HEADER_DELTA) != header[5] * CHECKPOINT_NODE) {
+		put_checkpoint(delta);
+		return NULL;
+	}
+	return delta;
+}
+
+// Returns offset rounded up to a whole block
+static off_t block_aligned(off_t offset) {
+	return (offset + LOG_ENTRY_BLOCK - 1) / LOG_ENTRY_BLOCK * LOG_ENTRY_BLOCK;
+}
+
+// Returns where slot starts in the checkpoint area
+static off_t slot_at(uint32_t slot) {
+	return (off_t) slot * CHECKPOINT_SLOT;
+}
+
+// Builds the graph from the checkpoint on fd: its base, then every delta the superblock counts after it.
+// Returns false if the base or one of those deltas is missing or corrupt
+bool load_checkpoint(int fd) {
+	checkpoint_area *loaded = get_checkpoint(fd, slot_at(checkpoint_slot));
+	// a formatted device has an empty checkpoint, so there is always one to load
+	if (loaded == NULL) {
+		fprintf(stderr, "Checkpoint in slot %" PRIu32 " is corrupt\n", checkpoint_slot);
+		return false;
+	}
+	if (!buildmap(loaded)) {
+		put_checkpoint(loaded);
+		fprintf(stderr, "Checkpoint in slot %" PRIu32 " does not match its node and edge counts\n", checkpoint_slot);
+		return false;
+	}
+	base_bytes = loaded->bytes;
+	deltas_bytes = 0;
+	put_checkpoint(loaded);
+	delta_at = slot_at(checkpoint_slot) + block_aligned(base_bytes);
+	for (uint32_t i = 1; i <= checkpoint_deltas; i++) {
+		checkpoint_area *delta = load_delta(fd, delta_at, i);
+		if (delta == NULL || !apply_delta(delta)) {
+			if (delta) put_checkpoint(delta);
+			fprintf(stderr, "Checkpoint delta %" PRIu32 " of %" PRIu32 " is corrupt\n", i, checkpoint_deltas);
+			return false;
+		}
+		deltas_bytes += delta->bytes;
+		delta_at = block_aligned(delta_at + delta->bytes);
+		put_checkpoint(delta);
+	}
+	if (checkpoint_deltas > 0) fprintf(stderr, "Applied %" PRIu32 " checkpoint deltas\n", checkpoint_deltas);
+
+	// what was loaded is checkpointed already
+	uint64_t *ids;
+	take_dirty(&ids);
+	free(ids);
+	return true;
+}
+
+// Returns the checkpoint at byte at of the checkpoint area on fd mapped read-only, its arrays pointing
+// into the mapping, or NULL if there is none to map; a v3 or v4 checkpoint is decoded instead. Release
+// it with put_checkpoint
+checkpoint_area *get_checkpoint(int fd, off_t at){
+	uint64_t header[4];
+	if (pread(fd, header, CHECKPOINT_HEADER_V3, LOG_SIZE + at) != CHECKPOINT_HEADER_V3) return NULL;
+	if (header[0] == CHECKPOINT_MAGIC_V3) return load_v3(fd, at, header, CHECKPOINT_V3);
+	if (header[0] == CHECKPOINT_MAGIC_V4) return load_v3(fd, at, header, CHECKPOINT_V4);
+	int version = header[0] == CHECKPOINT_MAGIC ? CHECKPOINT_V2 : CHECKPOINT_V1;
+	uint64_t *sizes = version == CHECKPOINT_V2 ? header + 1 : header;	// nsize, esize
+	// sizes that cannot fit are garbage, and a mapping past the end of the device faults
+	if (sizes[0] > CHECKPOINT_AREA / CHECKPOINT_NODE || sizes[1] > CHECKPOINT_AREA / CHECKPOINT_EDGE) return NULL;
+	uint64_t cpsize = checkpoint_size(version, sizes[0], sizes[1]);
+	off_t end = lseek(fd, 0, SEEK_END);
+	if (cpsize > CHECKPOINT_AREA - at || end < 0 || (uint64_t) end < LOG_SIZE + at + cpsize) return NULL;
+
+	char *area = mmap(NULL, cpsize, PROT_READ, MAP_SHARED, fd, LOG_SIZE + at);
+	if (area == MAP_FAILED) return NULL;
+	// the graph is built going through the arrays once, front to back, so read them ahead of it
+	madvise(area, cpsize, MADV_SEQUENTIAL);
+	madvise(area, cpsize, MADV_WILLNEED);
+
+	checkpoint_area *new = calloc(1, sizeof(struct checkpoint_area));
+	new->version = version;
+	new->bytes = cpsize;
+	new->nsize = sizes[0];
+	new->esize = sizes[1];
+	if (version == CHECKPOINT_V1) {
+		new->nodes = (uint64_t *) (area + CHECKPOINT_HEADER);
+		new->edges = (mem_edge *) (area + CHECKPOINT_HEADER + new->nsize * CHECKPOINT_NODE);
+		return new;
+	}
+	new->nodes = (uint64_t *) (area + CHECKPOINT_HEADER_V2);
+	new->offsets = new->nodes + new->nsize;
+	new->neighbors = new->offsets + new->nsize + 1;
+	// the offsets index the neighbors, so they have to be in order and in range
+	bool ok = new->offsets[0] == 0 && new->offsets[new->nsize] == 2 * new->esize;
+	for (uint64_t i = 0; ok && i < new->nsize; i++) ok = new->offsets[i] <= new->offsets[i + 1];
+	if (!ok) {
+		put_checkpoint(new);
+		return NULL;
+	}
+	return new;
+}
+
+// Unmaps a checkpoint returned by get_checkpoint
+void put_checkpoint(checkpoint_area *loaded){
+	if (loaded->version == CHECKPOINT_V3 || loaded->version == CHECKPOINT_V4 || loaded->version == CHECKPOINT_DELTA) {
+		free(loaded->nodes);
+		free(loaded->offsets);
+		free(loaded->neighbors);
+		free(loaded->removed);
+		free(loaded);
+		return;
+	}
+	uint64_t header = loaded->version == CHECKPOINT_V1 ? CHECKPOINT_HEADER : CHECKPOINT_HEADER_V2;
+	munmap((char *) loaded->nodes - header, checkpoint_size(loaded->version, loaded->nsize, loaded->esize));
+	free(loaded);
+}
+
+// Checkpoint data staged for one large write
+typedef struct cp_buffer {
+	int out;
+	char *buf;	// CHECKPOINT_BUFFER bytes, aligned for O_DIRECT
+	size_t used;
+	off_t offset;	// where buf goes in the checkpoint area
+	uint32_t crc;	// CRC32C of the data staged since the last cp_crc
+	size_t summed;	// bytes of buf already in crc
+} cp_buffer;
+
+// Returns the CRC32C of the data staged since the last call
+static uint32_t cp_crc(cp_buffer *b) {
+	uint32_t crc = crc32c(b->crc, b->buf + b->summed, b->used - b->summed);
+	b->crc = 0;
+	b->summed = b->used;
+	return crc;
+}
+
+// Writes out the staged data, padded to whole blocks if last, returns false on failure
+static bool cp_flush(cp_buffer *b, bool last) {
+	b->crc = crc32c(b->crc, b->buf + b->summed, b->used - b->summed);
+	b->summed = 0;
+	size_t length = b->used;
+	if (last) {
+		length = (length + LOG_ENTRY_BLOCK - 1) / LOG_ENTRY_BLOCK * LOG_ENTRY_BLOCK;
+		memset(b->buf + b->used, 0, length - b->used);
+	}
+	if (length > 0 && pwrite(b->out, b->buf, length, b->offset) != length) return false;
+	b->offset += length;
+	b->used = 0;
+	return true;
+}
+
+// Stages length bytes of data, writing the buffer out each time it fills, returns false on failure
+static bool cp_append(cp_buffer *b, const void *data, size_t length) {
+	const char *bytes = data;
+	while (length > 0) {
+		size_t n = CHECKPOINT_BUFFER - b->used;
+		if (n > length) n = length;
+		memcpy(b->buf + b->used, bytes, n);
+		b->used += n;
+		bytes += n;
+		length -= n;
+		if (b->used == CHECKPOINT_BUFFER && !cp_flush(b, false)) return false;
+	}
+	return true;
+}
+
+// Stages v as a varint, returns false on failure
+static bool cp_varint(cp_buffer *b, uint64_t v) {
+	char bytes[10];
+	// straight into the buffer unless it might fill up part way
+	char *p = CHECKPOINT_BUFFER - b->used >= sizeof(bytes) ? b->buf + b->used : bytes;
+	int n = 0;
+	for (; v >= 0x80; v >>= 7) p[n++] = (char) (v | 0x80);
+	p[n++] = (char) v;
+	if (p == bytes) return cp_append(b, bytes, n);
+	b->used += n;
+	return true;
+}
+
+// Compares two neighbor ids for qsort
+static int compare_ids(const void *x, const void *y) {
+	uint64_t a = *(const uint64_t *) x;
+	uint64_t b = *(const uint64_t *) y;
+	return (a > b) - (a < b);
+}
+
+// Node of a block being put in id order
+typedef struct block_node {
+	uint64_t id;
+	uint64_t i;
+} block_node;
+
+// Compares two block nodes by id for qsort
+static int compare_block_nodes(const void *x, const void *y) {
+	uint64_t a = ((const block_node *) x)->id;
+	uint64_t b = ((const block_node *) y)->id;
+	return (a > b) - (a < b);
+}
+
+// Puts nodes first to stop of flat_graph in id order, their neighbor runs moving with them
+static void sort_block(checkpoint_area *flat_graph, uint64_t first, uint64_t stop) {
+	uint64_t n = stop - first;
+	uint64_t base = flat_graph->offsets[first];
+	uint64_t n_neighbors = flat_graph->offsets[stop] - base;
+	block_node *order = malloc(sizeof(block_node) * n);
+	uint64_t *neighbors = malloc(sizeof(uint64_t) * n_neighbors);
+	if (!order || (n_neighbors && !neighbors)) exit(1);
+	for (uint64_t i = 0; i < n; i++) order[i] = (block_node) { flat_graph->nodes[first + i], first + i };
+	qsort(order, n, sizeof(block_node), compare_block_nodes);
+	memcpy(neighbors, flat_graph->neighbors + base, sizeof(uint64_t) * n_neighbors);
+
+	uint64_t k = base;
+	uint64_t *runs = malloc(sizeof(uint64_t) * (n + 1));	// old offsets, relative to base
+	if (!runs) exit(1);
+	for (uint64_t i = 0; i <= n; i++) runs[i] = flat_graph->offsets[first + i] - base;
+	for (uint64_t i = 0; i < n; i++) {
+		uint64_t from = order[i].i - first;
+		uint64_t degree = runs[from + 1] - runs[from];
+		flat_graph->nodes[first + i] = order[i].id;
+		flat_graph->offsets[first + i] = k;
+		memcpy(flat_graph->neighbors + k, neighbors + runs[from], sizeof(uint64_t) * degree);
+		k += degree;
+	}
+	free(runs);
+	free(neighbors);
+	free(order);
+}
+
+// v4 checkpoint being encoded by the writer threads, each taking an equal share of the blocks
+static struct {
+	checkpoint_area *graph;
+	uint64_t *index;
+	uint64_t nblocks;
+	int out;
+	off_t at;	// where the image goes in the checkpoint area
+	off_t share_at[CHECKPOINT_WORKERS];	// where each share goes in the image, block aligned
+	bool failed;
+} encoding;
+
+// Returns the first node of block b of the checkpoint being encoded, b up to nblocks
+static uint64_t block_start(uint64_t b) {
+	uint64_t first = b * CHECKPOINT_BLOCK_NODES;
+	return first < encoding.graph->nsize ? first : encoding.graph->nsize;
+}
+
+// Puts each block of share i of n in id order and sorts the neighbors of its nodes, leaving the size
+// of each block's data and its first neighbor in the index
+static void plan_blocks(int i, int n) {
+	checkpoint_area *g = encoding.graph;
+	for (uint64_t b = encoding.nblocks * i / n; b < encoding.nblocks * (i + 1) / n; b++) {
+		uint64_t first = block_start(b), stop = block_start(b + 1);
+		// flattening sorts each range of the table on its own; a block where two meet is sorted here
+		for (uint64_t j = first + 1; j < stop; j++) {
+			if (g->nodes[j] < g->nodes[j - 1]) {
+				sort_block(g, first, stop);
+				break;
+			}
+		}
+
+		uint64_t bytes = 0;
+		uint64_t id = 0;
+		for (uint64_t j = first; j < stop; j++) {
+			uint64_t *neighbors = g->neighbors + g->offsets[j];
+			uint64_t degree = g->offsets[j + 1] - g->offsets[j];
+			qsort(neighbors, degree, sizeof(uint64_t), compare_ids);
+			bytes += varint_size(g->nodes[j] - id) + varint_size(degree);
+			id = g->nodes[j];
+			for (uint64_t d = 0; d < degree; d++) {
+				bytes += varint_size(d == 0 ? zigzag(id, neighbors[0]) : neighbors[d] - neighbors[d - 1]);
+			}
+		}
+		encoding.index[3 * b] = bytes;
+		encoding.index[3 * b + 1] = g->offsets[first];
+	}
+}
+
+// Encodes share i of n of the blocks and writes it where it was planned to go, leaving each block's
+// checksum in the index
+static void encode_blocks(int i, int n) {
+	static const unsigned char zeros[LOG_ENTRY_BLOCK];
+	checkpoint_area *g = encoding.graph;
+	cp_buffer b = { encoding.out, NULL, 0, LOG_SIZE + encoding.at + encoding.share_at[i], 0, 0 };
+	if (posix_memalign((void **) &b.buf, LOG_ENTRY_BLOCK, CHECKPOINT_BUFFER)) {
+		__atomic_store_n(&encoding.failed, true, __ATOMIC_RELAXED);
+		return;
+	}
+	bool ok = true;
+	for (uint64_t k = encoding.nblocks * i / n; ok && k < encoding.nblocks * (i + 1) / n; k++) {
+		off_t start = b.offset + b.used;
+		uint64_t id = 0;
+		for (uint64_t j = block_start(k); ok && j < block_start(k + 1); j++) {
+			uint64_t *neighbors = g->neighbors + g->offsets[j];
+			uint64_t degree = g->offsets[j + 1] - g->offsets[j];
+			ok = cp_varint(&b, g->nodes[j] - id) && cp_varint(&b, degree);
+			id = g->nodes[j];
+			for (uint64_t d = 0; ok && d < degree; d++) {
+				ok = cp_varint(&b, d == 0 ? zigzag(id, neighbors[0]) : neighbors[d] - neighbors[d - 1]);
+			}
+		}
+		if (!ok) break;
+		// the last block of a share runs on over the padding after it
+		uint64_t padding = encoding.index[3 * (k + 1)] - encoding.index[3 * k] - (b.offset + b.used - start);
+		encoding.index[3 * k + 2] = crc32c(cp_crc(&b), zeros, padding);
+	}
+	// the padding to a whole block is where the next share starts
+	if (!ok || !cp_flush(&b, true)) __atomic_store_n(&encoding.failed, true, __ATOMIC_RELAXED);
+	free(b.buf);
+}
+
+// Writes g at byte at of the checkpoint area on out as head_size bytes of head, a v4 index and v3 blocks,
+// and sets bytes to the size of the image; if it would not end by byte limit, writes nothing and sets bytes
+// to 0. Returns 0 on failure. The blocks are split into shares that threads plan and then encode at once,
+// each share writing CHECKPOINT_BUFFER at a time from a block aligned offset worked out in between. The
+// head and index go last, once the blocks' checksums are in the index.
+static int write_image(int out, off_t at, off_t limit, const void *head, uint64_t head_size, checkpoint_area *g, uint64_t *bytes) {
+	int n = checkpoint_workers();
+	encoding.graph = g;
+	encoding.nblocks = (g->nsize + CHECKPOINT_BLOCK_NODES - 1) / CHECKPOINT_BLOCK_NODES;
+	encoding.out = out;
+	encoding.at = at;
+	encoding.failed = false;
+	uint64_t index_size = CHECKPOINT_INDEX_V4 * (encoding.nblocks + 1);
+	encoding.index = malloc(index_size);
+	if (!encoding.index) return 0;
+	run_workers(plan_blocks, n);
+
+	// block sizes become offsets from the start of the data, each share starting on a new block
+	uint64_t data = head_size + index_size;
+	uint64_t pos = data;
+	for (int i = 0; i < n; i++) {
+		pos = block_aligned(pos);
+		encoding.share_at[i] = pos;
+		for (uint64_t b = encoding.nblocks * i / n; b < encoding.nblocks * (i + 1) / n; b++) {
+			uint64_t size = encoding.index[3 * b];
+			encoding.index[3 * b] = pos - data;
+			pos += size;
+		}
+	}
+	encoding.index[3 * encoding.nblocks] = pos - data;
+	encoding.index[3 * encoding.nblocks + 1] = g->offsets[g->nsize];
+	*bytes = pos;
+	if (at + *bytes > limit) {
+		*bytes = 0;
+		free(encoding.index);
+		return 1;
+	}
+
+	run_workers(encode_blocks, n);
+	cp_buffer b = { out, NULL, 0, LOG_SIZE + at, 0, 0 };
+	if (encoding.failed || posix_memalign((void **) &b.buf, LOG_ENTRY_BLOCK, CHECKPOINT_BUFFER)) {
+		free(encoding.index);
+		return 0;
+	}
+	// the last checksum covers everything staged before it
+	bool ok = cp_append(&b, head, head_size) && cp_append(&b, encoding.index, index_size - sizeof(uint64_t));
+	encoding.index[3 * encoding.nblocks + 2] = cp_crc(&b);
+	ok = ok && cp_append(&b, encoding.index + 3 * encoding.nblocks + 2, sizeof(uint64_t)) && cp_flush(&b, true);
+	free(b.buf);
+	free(encoding.index);
+	return ok;
+}
+
+// Writes checkpoint new to the checkpoint slot starting at byte at of the checkpoint area on out as v4 and
+// sets bytes to its size; if it would not fit the slot, writes nothing and sets bytes to 0. Returns 0 on failure
+int write_cp(int out, checkpoint_area *new, off_t at, uint64_t *bytes){
+	uint64_t header[4] = { CHECKPOINT_MAGIC_V4, new->nsize, new->esize, (new->nsize + CHECKPOINT_BLOCK_NODES - 1) / CHECKPOINT_BLOCK_NODES };
+	return write_image(out, at, at + CHECKPOINT_SLOT, header, CHECKPOINT_HEADER_V3, new, bytes);
+}
+
+// Writes delta number seq at byte at of the checkpoint area on out and sets bytes to its size; if it would
+// not fit the slot of the base, writes nothing and sets bytes to 0. Returns 0 on failure
+static int write_delta(int out, checkpoint_area *delta, off_t at, uint64_t seq, uint64_t *bytes) {
+	uint64_t head_size = CHECKPOINT_HEADER_DELTA + delta->n_removed * CHECKPOINT_NODE;
+	uint64_t *head = malloc(head_size);
+	if (!head) return 0;
+	head[0] = CHECKPOINT_MAGIC_DELTA_V4;
+	head[1] = seq;
+	head[2] = delta->nsize;
+	head[3] = delta->offsets[delta->nsize];
+	head[4] = (delta->nsize + CHECKPOINT_BLOCK_NODES - 1) / CHECKPOINT_BLOCK_NODES;
+	head[5] = delta->n_removed;
+	memcpy(head + 6, delta->removed, delta->n_removed * CHECKPOINT_NODE);
+	int ok = write_image(out, at, slot_at(checkpoint_slot) + CHECKPOINT_SLOT, head, head_size, delta, bytes);
+	free(head);
+	return ok;
 }
 
 int clear_checkpoint_area(){
@@ -326,9 +1107,200 @@ int clear_checkpoint_area(){
 	return 1;
 }
 
-int docheckpoint(checkpoint_area *new){
-	update_superblock();
-	return write_cp(fd, new);
+// Returns the monotonic clock in seconds
+static double now_seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns a flat copy of the graph made by make_checkpoint
+static checkpoint_area* flatten_graph() {
+	checkpoint_area *flat_graph = calloc(1, sizeof(struct checkpoint_area));
+	flat_graph->version = CHECKPOINT_V2;
+	flat_graph->nsize = map.nsize;
+	flat_graph->esize = map.esize;
+	flat_graph->nodes = malloc(sizeof(uint64_t) * map.nsize);
+	flat_graph->offsets = malloc(sizeof(uint64_t) * (map.nsize + 1));
+	flat_graph->neighbors = malloc(sizeof(uint64_t) * 2 * map.esize);
+	if (!flat_graph->nodes || !flat_graph->offsets || (map.esize && !flat_graph->neighbors)) exit(1);
+	make_checkpoint(flat_graph);
+	return flat_graph;
+}
+
+// Returns a flat copy of the vertices changed before the checkpoint started, made by make_delta
+static checkpoint_area* flatten_delta() {
+	checkpoint_area *delta = calloc(1, sizeof(struct checkpoint_area));
+	delta->version = CHECKPOINT_DELTA;
+	make_delta(delta, checkpoint_dirty, checkpoint_n_dirty);
+	return delta;
+}
+
+// Returns a flat copy of what the checkpoint starting is to write
+static checkpoint_area* flatten() {
+	return checkpoint_delta ? flatten_delta() : flatten_graph();
+}
+
+// Frees a checkpoint_area made by flatten
+static void free_checkpoint(checkpoint_area *flat_graph) {
+	free(flat_graph->nodes);
+	free(flat_graph->offsets);
+	free(flat_graph->neighbors);
+	free(flat_graph->removed);
+	free(flat_graph);
+}
+
+// Writes flat_graph, made by flatten, as the checkpoint running, returns 0 on failure
+static int write_checkpoint(checkpoint_area *flat_graph) {
+	if (checkpoint_delta) return write_delta(log_fd, flat_graph, delta_at, checkpoint_deltas + 1, checkpoint_written_bytes);
+	return write_cp(log_fd, flat_graph, slot_at(!checkpoint_slot), checkpoint_written_bytes);
+}
+
+// Writes the checkpoint and flushes it, leaving the superblock to the event loop
+static void* checkpoint_writer(void *arg) {
+	if (!write_checkpoint(checkpoint_graph)) exit(2);
+	if (durability != DURABILITY_NONE && fdatasync(log_fd)) exit(2);
+	__atomic_store_n(&checkpoint_written, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+// Forks a process that writes the graph as of now from its copy-on-write view of memory,
+// returns false if it could not be forked
+static bool fork_checkpoint() {
+	pid_t pid = fork();
+	if (pid == -1) return false;
+	if (pid == 0) {
+		// the parent keeps changing the graph; this process sees it as it was at the fork
+		checkpoint_area *flat_graph = flatten();
+		bool ok = write_checkpoint(flat_graph) && (durability == DURABILITY_NONE || !fdatasync(log_fd));
+		_exit(ok ? 0 : 2);
+	}
+	checkpoint_child = pid;
+	return true;
+}
+
+// Starts checkpointing the graph as of now in the background, returns false if it cannot fit the
+// checkpoint area; whether it does is only known once it is encoded. The log goes on in the next
+// generation, after the blocks the checkpoint replaces.
+bool checkpoint_start() {
+	// one checkpoint is written at a time; every request that comes meanwhile is answered by the next
+	// one, which the event loop starts once this one is done
+	if (checkpointing) {
+		if (!checkpoint_queued) checkpoints_started++;
+		checkpoint_queued = true;
+		checkpoint_requests++;
+		return true;
+	}
+	if (checkpoint_size(CHECKPOINT_V4, map.nsize, map.esize) > CHECKPOINT_SLOT) {
+		if (!checkpoint_queued) return false;
+		// a queued checkpoint that no longer fits is done without being written, and answered 507
+		checkpoint_queued = false;
+		checkpoint_bytes = 0;
+		checkpoints_done++;
+		return true;
+	}
+	// staged entries belong to the generation being checkpointed
+	commit_log();
+	checkpoint_blocks = tail + (((log_entry_block_header *) tail_block)->n_entries > 0);
+	generation++;
+	tail = checkpoint_blocks;
+	reset_tail_block();
+	checkpointing = true;
+	// a queued checkpoint was numbered when it was asked for
+	if (!checkpoint_queued) {
+		checkpoints_started++;
+		checkpoint_requests++;
+	}
+	checkpoint_queued = false;
+	checkpoint_began = now_seconds();
+
+	// a delta of the vertices changed since the last checkpoint is written unless too many have piled
+	// up, they outgrow the base, most of the graph changed, or the slot left after them holds less
+	// than the base; a full checkpoint starts a new base in the other slot
+	checkpoint_n_dirty = take_dirty(&checkpoint_dirty);
+	checkpoint_delta = !full_due && checkpoint_deltas < checkpoint_deltas_max && deltas_bytes < base_bytes
+		&& checkpoint_n_dirty <= map.nsize / 2 && delta_at + base_bytes <= slot_at(checkpoint_slot) + CHECKPOINT_SLOT;
+	if (checkpoint_written_bytes == NULL) {
+		checkpoint_written_bytes = mmap(NULL, sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (checkpoint_written_bytes == MAP_FAILED) exit(1);
+	}
+
+	// without fork, the graph is copied here and written by a thread
+	if (checkpoint_mode == CHECKPOINT_FORK && fork_checkpoint()) return true;
+	checkpoint_child = 0;
+	checkpoint_graph = flatten();
+	checkpoint_written = false;
+	if (pthread_create(&checkpoint_thread, NULL, checkpoint_writer, NULL)) exit(1);
+	return true;
+}
+
+// Completes the background checkpoint once it is written, waiting for it if wait;
+// returns true if no checkpoint is left running
+bool finish_checkpoint(bool wait) {
+	if (!checkpointing) return true;
+	if (checkpoint_child) {
+		int status;
+		pid_t pid;
+		while ((pid = waitpid(checkpoint_child, &status, wait ? 0 : WNOHANG)) == -1 && errno == EINTR);
+		if (pid == 0) return false;
+		// the child failing to write is as fatal as it is for the thread
+		if (pid == -1 || !WIFEXITED(status) || WEXITSTATUS(status)) exit(2);
+	} else {
+		if (!wait && !__atomic_load_n(&checkpoint_written, __ATOMIC_ACQUIRE)) return false;
+		pthread_join(checkpoint_thread, NULL);
+		free_checkpoint(checkpoint_graph);
+	}
+	checkpointing = false;
+	checkpoint_bytes = *checkpoint_written_bytes;
+	checkpoint_was_delta = checkpoint_delta;
+	checkpoint_seconds = now_seconds() - checkpoint_began;
+	checkpoints_done++;
+
+	// a checkpoint that did not fit left the area as it was: the log goes on from the old start,
+	// chaining into the new generation, and a background checkpoint waits for half the rest of it.
+	// What changed is still to be checkpointed, by a full checkpoint if a delta did not fit
+	if (checkpoint_bytes == 0) {
+		restore_dirty(checkpoint_dirty, checkpoint_n_dirty);
+		free(checkpoint_dirty);
+		full_due = full_due || checkpoint_delta;
+		checkpoint_retry = tail + (MAX_BLOCKS - tail) / 2;
+		return true;
+	}
+	free(checkpoint_dirty);
+	full_due = false;
+	if (checkpoint_delta) {
+		checkpoint_deltas++;
+		deltas_bytes += checkpoint_bytes;
+		delta_at = block_aligned(delta_at + checkpoint_bytes);
+	} else {
+		// the superblock written next switches slots; until then the old base and its deltas stand
+		checkpoint_slot = !checkpoint_slot;
+		checkpoint_deltas = 0;
+		base_bytes = checkpoint_bytes;
+		deltas_bytes = 0;
+		delta_at = slot_at(checkpoint_slot) + block_aligned(checkpoint_bytes);
+	}
+
+	// the log now starts at the new generation; the blocks before it are free for reuse
+	uint32_t start = (log_start + checkpoint_blocks) % MAX_BLOCKS;
+	if (!update_superblock(start)) exit(2);
+	if (durability != DURABILITY_NONE && fdatasync(log_fd)) exit(2);
+	log_start = start;
+	tail -= checkpoint_blocks;
+	checkpoint_retry = 0;
+	return true;
+}
+
+// Returns true if the log is full enough that a background checkpoint should start
+bool checkpoint_due() {
+	if (checkpointing) return false;
+	return checkpoint_queued || (checkpoint_at > 0 && tail >= checkpoint_at * MAX_BLOCKS && tail >= checkpoint_retry);
+}
+
+// Checkpoints the graph and waits for it, returns false if it does not fit the checkpoint area
+bool docheckpoint() {
+	full_due = true;
+	return checkpoint_start() && finish_checkpoint(true) && checkpoint_bytes > 0;
 }
 
 // Writes whole LOG section (all 2 GB) with 0
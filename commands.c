@@ -0,0 +1,72 @@
+/*
+ * commands.c
+ *
+ * by Stylianos Rousoglou
+ * and Alex Saiontz
+ *
+ * Provides the graph commands shared by
+ * every protocol the server speaks; each
+ * returns the HTTP status code of the result
+ */
+
+#include "headers.h"
+
+extern vertex_map map;	// hashtable storing the graph
+extern int fd;
+
+// Adds node id and logs it, returns 200, 204 or 507
+int cmd_add_node(uint64_t id) {
+	if (!add_vertex(id)) return 204;
+	return add_to_log(ADD_NODE, id, 0) ? 200 : 507;
+}
+
+// Adds edge a-b and logs it, returns 200, 204, 400 or 507
+int cmd_add_edge(uint64_t a, uint64_t b) {
+	int code = add_edge(a, b);
+	if (code != 200) return code;
+	return add_to_log(ADD_EDGE, a, b) ? 200 : 507;
+}
+
+// Removes node id and logs it, returns 200, 400 or 507
+int cmd_remove_node(uint64_t id) {
+	if (!remove_vertex(id)) return 400;
+	return add_to_log(REMOVE_NODE, id, 0) ? 200 : 507;
+}
+
+// Removes edge a-b and logs it, returns 200, 400 or 507
+int cmd_remove_edge(uint64_t a, uint64_t b) {
+	if (!remove_edge(a, b)) return 400;
+	return add_to_log(REMOVE_EDGE, a, b) ? 200 : 507;
+}
+
+// Sets in_graph to whether node id exists, returns 200
+int cmd_get_node(uint64_t id, bool *in_graph) {
+	*in_graph = get_node(id);
+	return 200;
+}
+
+// Sets in_graph to whether edge a-b exists, returns 200 or 400
+int cmd_get_edge(uint64_t a, uint64_t b, bool *in_graph) {
+	if (!get_node(a) || !get_node(b)) return 400;
+	*in_graph = get_edge(a, b);
+	return 200;
+}
+
+// Sets neighbors to a malloced array of size n, returns 200 or 400
+int cmd_get_neighbors(uint64_t id, uint64_t **neighbors, int *n) {
+	if (!get_node(id)) return 400;
+	*neighbors = get_neighbors(id, n);
+	return 200;
+}
+
+// Sets distance to the shortest path from a to b, returns 200, 204 or 400
+int cmd_shortest_path(uint64_t a, uint64_t b, int *distance) {
+	if (!ret_vertex(a) || !ret_vertex(b)) return 400;
+	*distance = shortest_path(a, b);
+	return (*distance == -1) ? 204 : 200;
+}
+
+// Starts checkpointing the graph in the background, returns 200 or 507
+int cmd_checkpoint() {
+	return checkpoint_start() ? 200 : 507;
+}
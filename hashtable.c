@@ -19,30 +19,88 @@
 // global hashtable for vertices
 vertex_map map;
 
+// Vertices and edges buildmap allocated in one block each; they are never freed one by one
+static vertex *bulk_vertices;
+static uint64_t bulk_n_vertices;
+static edge *bulk_edges;
+static uint64_t bulk_n_edges;
+
+// Ids of the vertices changed since the last checkpoint started, some possibly removed since;
+// a live vertex is listed once, a removed one maybe more
+static uint64_t *dirty;
+static uint64_t n_dirty;
+static uint64_t dirty_size;
+
+// Frees vertex v unless it lives in the block buildmap allocated
+static void free_vertex(vertex *v) {
+	if ((uintptr_t) v - (uintptr_t) bulk_vertices >= bulk_n_vertices * sizeof(vertex)) free(v);
+}
+
+// Frees edge e unless it lives in the block buildmap allocated
+static void free_edge(edge *e) {
+	if ((uintptr_t) e - (uintptr_t) bulk_edges >= bulk_n_edges * sizeof(edge)) free(e);
+}
+
+// Lists id among the dirty vertices
+static void list_dirty(uint64_t id) {
+	if (n_dirty == dirty_size) {
+		dirty_size = dirty_size ? 2 * dirty_size : 1024;
+		dirty = realloc(dirty, sizeof(uint64_t) * dirty_size);
+		if (!dirty) exit(1);
+	}
+	dirty[n_dirty++] = id;
+}
+
+// Marks vertex v changed since the last checkpoint
+static void mark_dirty(vertex *v) {
+	if (v->dirty) return;
+	v->dirty = 1;
+	list_dirty(v->id);
+}
+
 // Returns hash value
-int hash_vertex(uint64_t id) {
-	return id % SIZE;
+size_t hash_vertex(uint64_t id) {
+	return id % map.capacity;
 }
 
 // Returns pointer to vertex id, or NULL if it doesn't exist
 vertex *ret_vertex(uint64_t id) {
-	int hash = hash_vertex(id);
+	size_t hash = hash_vertex(id);
 	vertex** table = map.table;
 	vertex* index = table[hash];
 
-	if(index != NULL) {
+	while(index) {
 		if(index->id == id) return index;
-		while(index->next) {
-			if(index->id == id) return index;
-			index = index->next;
-		}
+		index = index->next;
 	}
 	return NULL;
 }
 
+// Grows the hashtable to at least n buckets, rehashing existing vertices; returns false, leaving it as it
+// was, if they cannot be allocated
+bool reserve_vertices(size_t n) {
+	if (n <= map.capacity) return true;
+	vertex** table = calloc(n, sizeof(vertex*));
+	if(!table) return false;
+
+	for (size_t bin = 0; bin < map.capacity; bin++) {
+		vertex* index = map.table[bin];
+		while(index) {
+			vertex* next = index->next;
+			index->next = table[index->id % n];
+			table[index->id % n] = index;
+			index = next;
+		}
+	}
+	free(map.table);
+	map.table = table;
+	map.capacity = n;
+	return true;
+}
+
 // Adds vertex, returns false is vertex existed
 bool add_vertex(uint64_t id) {
-	int hash = hash_vertex(id);
+	size_t hash = hash_vertex(id);
 	vertex** table = map.table;
 
 	if(ret_vertex(id)) return false;
@@ -53,9 +111,10 @@ bool add_vertex(uint64_t id) {
 	new->next = table[hash];
 	new->head = NULL;
 	new->path = -1;
-	new->visited = 0;
+	new->dirty = 0;
 	table[hash] = new;
 	map.nsize += 1;
+	mark_dirty(new);
 	return true;
 }
 
@@ -63,8 +122,13 @@ bool add_vertex(uint64_t id) {
 void fix_edges(vertex *out){
 	edge *head = out->head;
 	uint64_t id = out->id;
+	// the vertex goes, and every neighbor loses an edge
+	if (!out->dirty) list_dirty(id);
 	while(head){
-		LL_delete(&((ret_vertex(head->b))->head), id);
+		vertex *neighbor = ret_vertex(head->b);
+		LL_delete(&(neighbor->head), id);
+		mark_dirty(neighbor);
+		map.esize -= 1;
 		head=head->next;
 	}
 }
@@ -79,7 +143,7 @@ bool delete_vertex(vertex** head, uint64_t id)
         if(tmp->id == id) {
             fix_edges(tmp);
             tmp = tmp->next;
-            free(*head);
+            free_vertex(*head);
             *head = tmp;
             return true;
         }
@@ -89,7 +153,7 @@ bool delete_vertex(vertex** head, uint64_t id)
             if(tmp->next->id == id) {
                 vertex* tmp2 = tmp->next->next;
                 fix_edges(tmp->next);
-                free(tmp->next);
+                free_vertex(tmp->next);
                 tmp->next = tmp2;
                 return true;
             }
@@ -101,7 +165,7 @@ bool delete_vertex(vertex** head, uint64_t id)
 
 // Removes vertex, returns false is vertex does not exist
 bool remove_vertex(uint64_t id) {
-	int hash = hash_vertex(id);
+	size_t hash = hash_vertex(id);
 	vertex** table = map.table;
 
 	if(delete_vertex(&(table[hash]), id)) {
@@ -169,7 +233,7 @@ bool LL_delete(edge** head, uint64_t n)
         edge* tmp = *head;
         if(tmp->b == n) {
             tmp = tmp->next;
-            free(*head);
+            free_edge(*head);
             *head = tmp;
             return true;
         }
@@ -178,7 +242,7 @@ bool LL_delete(edge** head, uint64_t n)
         {
             if(tmp->next->b == n) {
                 edge* tmp2 = tmp->next->next;
-                free(tmp->next);
+                free_edge(tmp->next);
                 tmp->next = tmp2;
                 return true;
             }
@@ -213,6 +277,8 @@ int add_edge(uint64_t a, uint64_t b) {
 	LL_insert(&(v1->head), b);
 	LL_insert(&(v2->head), a);
 	map.esize += 1;
+	mark_dirty(v1);
+	mark_dirty(v2);
 	return 200;
 }
 
@@ -236,8 +302,12 @@ bool remove_edge(uint64_t a, uint64_t b) {
 
 	// can't remove edge
 	if(!v1 || !v2) return false;
+	if (!LL_delete(&(v1->head), b)) return false;
+	LL_delete(&(v2->head), a);
 	map.esize -= 1;
-	return (LL_delete(&(v1->head), b) && LL_delete(&(v2->head), a));
+	mark_dirty(v1);
+	mark_dirty(v2);
+	return true;
 }
 
 /*
@@ -363,67 +433,295 @@ uint64_t *get_neighbors(uint64_t id, int* n){
 }
 
 
-bool is_unvisited(uint64_t id){
-	if ((ret_vertex(id))->visited){
-		return false;
-	}
-	return true;
+// Compares two ids for qsort
+static int compare_ids(const void *x, const void *y){
+	uint64_t a = *(const uint64_t *) x;
+	uint64_t b = *(const uint64_t *) y;
+	return (a > b) - (a < b);
+}
 
+// Compares two vertices by id for qsort
+static int compare_vertices(const void *x, const void *y){
+	uint64_t a = (*(vertex * const *) x)->id;
+	uint64_t b = (*(vertex * const *) y)->id;
+	return (a > b) - (a < b);
 }
-int do_edge_mem(mem_edge *edges, vertex *index, int edgei){
-	edge *head = index->head;
-	uint64_t id = index->id;
-	while(head){
-		if (is_unvisited(head->b)){
-			edges[edgei].a = id;
-			edges[edgei].b = head->b;
-			edgei++;
+
+// Flattening split across threads, each taking a range of the table's buckets
+static struct {
+	checkpoint_area *graph;
+	uint64_t node_at[CHECKPOINT_WORKERS + 1];	// first node of each range, after its count
+	uint64_t neighbor_at[CHECKPOINT_WORKERS + 1];	// first neighbor of each range, after its count
+} flattening;
+
+// Counts the vertices and neighbors in range i of n of the table
+static void count_range(int i, int n) {
+	uint64_t nodes = 0, neighbors = 0;
+	for (size_t bin = map.capacity * i / n; bin < map.capacity * (i + 1) / n; bin++){
+		for (vertex *index = map.table[bin]; index != NULL; index = index->next){
+			nodes++;
+			for (edge *head = index->head; head != NULL; head = head->next) neighbors++;
 		}
-		head = head->next;
 	}
-	return edgei;
+	flattening.node_at[i + 1] = nodes;
+	flattening.neighbor_at[i + 1] = neighbors;
+}
 
+// Fills range i of n of the table into its part of the arrays, its vertices in id order
+static void fill_range(int i, int n) {
+	checkpoint_area *flat_graph = flattening.graph;
+	uint64_t nodei = flattening.node_at[i];
+	uint64_t edgei = flattening.neighbor_at[i];
+	uint64_t count = flattening.node_at[i + 1] - nodei;
+	uint64_t j = 0;
+	vertex **sorted = malloc(sizeof(vertex*) * count);
+	if (count && !sorted) exit(1);
+	for (size_t bin = map.capacity * i / n; bin < map.capacity * (i + 1) / n; bin++){
+		for (vertex *index = map.table[bin]; index != NULL; index = index->next) sorted[j++] = index;
+	}
+	qsort(sorted, count, sizeof(vertex*), compare_vertices);
+
+	// every edge is listed from both ends, each node's neighbors after the previous node's
+	for (j = 0; j < count; j++){
+		flat_graph->nodes[nodei] = sorted[j]->id;
+		flat_graph->offsets[nodei++] = edgei;
+		for (edge *head = sorted[j]->head; head != NULL; head = head->next) flat_graph->neighbors[edgei++] = head->b;
+	}
+	free(sorted);
 }
 
 int make_checkpoint(checkpoint_area * flat_graph){
-	int nodei = 0;
-	int edgei = 0;
-	int bin;
-	vertex** table = map.table;
-	vertex *index;
-	for (bin=0; bin < SIZE; bin++){
-		index = table[bin];
-		while(index !=NULL){
-			edgei = do_edge_mem(flat_graph->edges, index, edgei);
-			flat_graph->nodes[nodei]=index->id;
-			nodei++;
-			index->visited=1;
-			index=index->next;	
-		}
+	int n = checkpoint_workers();
+	flattening.graph = flat_graph;
+	run_workers(count_range, n);
+
+	// each range goes right after the one before it
+	flattening.node_at[0] = 0;
+	flattening.neighbor_at[0] = 0;
+	for (int i = 0; i < n; i++){
+		flattening.node_at[i + 1] += flattening.node_at[i];
+		flattening.neighbor_at[i + 1] += flattening.neighbor_at[i];
 	}
+	run_workers(fill_range, n);
+	flat_graph->offsets[flattening.node_at[n]] = flattening.neighbor_at[n];
+	return 1;
+}
 
-	for (bin=0; bin < SIZE; bin++){
-		index = table[bin];
-		while(index !=NULL){
-			index->visited=0;
-			index=index->next;	
-		}
+// Allocates the vertices of the empty map in one block, linked into their buckets
+static void bulk_vertices_from(uint64_t *nodes, uint64_t nodenum){
+	if (!reserve_vertices(nodenum)) exit(1);
+	bulk_vertices = malloc(sizeof(vertex) * nodenum);
+	if (nodenum && !bulk_vertices) exit(1);
+	bulk_n_vertices = nodenum;
+
+	for (uint64_t i=0; i<nodenum; i++){
+		vertex *new = &bulk_vertices[i];
+		size_t hash = hash_vertex(nodes[i]);
+		new->id = nodes[i];
+		new->head = NULL;
+		new->path = -1;
+		new->dirty = 0;
+		new->next = map.table[hash];
+		map.table[hash] = new;
 	}
-	return 1;
+	map.nsize = nodenum;
+}
+
+// Links the runs of bulk_edges into adjacency lists, vertex i's ending before end[i]
+static void bulk_link_edges(uint64_t *end, uint64_t nodenum){
+	uint64_t first = 0;
+	for (uint64_t i=0; i<nodenum; i++){
+		for (uint64_t e = first; e < end[i]; e++) bulk_edges[e].next = e + 1 < end[i] ? &bulk_edges[e + 1] : NULL;
+		if (first < end[i]) bulk_vertices[i].head = &bulk_edges[first];
+		first = end[i];
+	}
+}
+
+// Fills the empty map from v1 checkpoint loaded in bulk: the checkpoint holds every vertex and edge
+// once, so nothing is looked up twice, and each adjacency list is one run of a single block of edges
+static int bulk_buildmap_v1(struct checkpoint_area * loaded){
+	uint64_t nodenum = loaded->nsize;
+	uint64_t edgenum = loaded->esize;
+	uint64_t i;
+
+	bulk_vertices_from(loaded->nodes, nodenum);
+	uint64_t *ends = malloc(sizeof(uint64_t) * 2 * edgenum);	// vertex index of each edge's endpoints
+	uint64_t *start = calloc(nodenum + 1, sizeof(uint64_t));	// first edge of each vertex
+	if ((edgenum && !ends) || !start) exit(1);
+
+	// first pass: resolve endpoints and count degrees; edges to missing vertices are dropped
+	uint64_t kept = 0;
+	for (i=0; i<edgenum; i++){
+		vertex *a = ret_vertex(loaded->edges[i].a);
+		vertex *b = ret_vertex(loaded->edges[i].b);
+		if (!a || !b || a == b) continue;
+		ends[2 * kept] = a - bulk_vertices;
+		ends[2 * kept + 1] = b - bulk_vertices;
+		start[ends[2 * kept] + 1]++;
+		start[ends[2 * kept + 1] + 1]++;
+		kept++;
+	}
+	for (i=0; i<nodenum; i++) start[i + 1] += start[i];
+
+	// second pass: place both directions of every edge in its endpoints' runs
+	bulk_edges = malloc(sizeof(edge) * 2 * kept);
+	if (kept && !bulk_edges) exit(1);
+	bulk_n_edges = 2 * kept;
+	for (i=0; i<kept; i++){
+		uint64_t a = ends[2 * i], b = ends[2 * i + 1];
+		bulk_edges[start[a]++].b = bulk_vertices[b].id;
+		bulk_edges[start[b]++].b = bulk_vertices[a].id;
+	}
+
+	// start now holds the end of each run
+	bulk_link_edges(start, nodenum);
+	map.esize = kept;
+
+	free(ends);
+	free(start);
+	return map.esize == edgenum;
+}
+
+// Fills the empty map from v2 or v3 checkpoint loaded in bulk: its neighbor array already has each
+// vertex's neighbors in one run, so it is copied straight into the edge block. Returns 0 if the
+// neighbors do not list every edge from both ends
+static int bulk_buildmap_v2(struct checkpoint_area * loaded){
+	uint64_t nodenum = loaded->nsize;
+	uint64_t n_neighbors = loaded->offsets[nodenum];
+
+	bulk_vertices_from(loaded->nodes, nodenum);
+	bulk_edges = malloc(sizeof(edge) * n_neighbors);
+	if (n_neighbors && !bulk_edges) exit(1);
+	bulk_n_edges = n_neighbors;
+	for (uint64_t e = 0; e < n_neighbors; e++) bulk_edges[e].b = loaded->neighbors[e];
+	bulk_link_edges(loaded->offsets + 1, nodenum);
+	map.esize = loaded->esize;
+	return n_neighbors == 2 * loaded->esize;
 }
 
 int buildmap(struct checkpoint_area * loaded){
-	int nodenum = loaded->nsize;
-	int edgenum = loaded->esize;
-	int i;
+	// checkpoints are only loaded into the empty map at startup, the one case the bulk build handles
+	if (map.nsize == 0 && bulk_vertices == NULL) {
+		return loaded->version == CHECKPOINT_V1 ? bulk_buildmap_v1(loaded) : bulk_buildmap_v2(loaded);
+	}
+
+	uint64_t nodenum = loaded->nsize;
+	uint64_t edgenum = loaded->esize;
+	uint64_t i;
 	for (i=0; i<nodenum; i++){
 		add_vertex(loaded->nodes[i]);
 	}
-	for (i=0; i<edgenum; i++){
-		add_edge(loaded->edges[i].a, loaded->edges[i].b);
+	if (loaded->version != CHECKPOINT_V1) {
+		// every edge is listed from both ends; add it from the lower one
+		for (i=0; i<nodenum; i++){
+			for (uint64_t e = loaded->offsets[i]; e < loaded->offsets[i + 1]; e++){
+				if (loaded->nodes[i] < loaded->neighbors[e]) add_edge(loaded->nodes[i], loaded->neighbors[e]);
+			}
+		}
+	} else {
+		for (i=0; i<edgenum; i++){
+			add_edge(loaded->edges[i].a, loaded->edges[i].b);
+		}
 	}
 	if (map.nsize != nodenum || map.esize != edgenum){
 		return 0;
 	}
 	return 1;
 }
+
+// Hands over, sorted and without repeats, the ids of the vertices changed since the last call
+// and starts listing anew; returns how many there are
+uint64_t take_dirty(uint64_t **ids){
+	uint64_t n = 0;
+	qsort(dirty, n_dirty, sizeof(uint64_t), compare_ids);
+	for (uint64_t i = 0; i < n_dirty; i++){
+		if (n > 0 && dirty[n - 1] == dirty[i]) continue;
+		dirty[n++] = dirty[i];
+		vertex *v = ret_vertex(dirty[i]);
+		if (v) v->dirty = 0;
+	}
+	*ids = dirty;
+	dirty = NULL;
+	n_dirty = dirty_size = 0;
+	return n;
+}
+
+// Lists the n ids taken by take_dirty as changed again, for a checkpoint of them that was not written
+void restore_dirty(uint64_t *ids, uint64_t n){
+	for (uint64_t i = 0; i < n; i++){
+		vertex *v = ret_vertex(ids[i]);
+		if (v) mark_dirty(v);
+		else list_dirty(ids[i]);
+	}
+}
+
+int make_delta(checkpoint_area * delta, uint64_t *ids, uint64_t n){
+	uint64_t nodei = 0, edgei = 0, removed = 0;
+	uint64_t i;
+	// size the arrays first
+	for (i = 0; i < n; i++){
+		vertex *v = ret_vertex(ids[i]);
+		if (!v) {
+			removed++;
+			continue;
+		}
+		nodei++;
+		for (edge *head = v->head; head != NULL; head = head->next) edgei++;
+	}
+	delta->nsize = nodei;
+	delta->nodes = malloc(sizeof(uint64_t) * nodei);
+	delta->offsets = malloc(sizeof(uint64_t) * (nodei + 1));
+	delta->neighbors = malloc(sizeof(uint64_t) * edgei);
+	delta->removed = malloc(sizeof(uint64_t) * removed);
+	if (!delta->nodes || !delta->offsets || (edgei && !delta->neighbors) || (removed && !delta->removed)) exit(1);
+
+	nodei = edgei = removed = 0;
+	for (i = 0; i < n; i++){
+		vertex *v = ret_vertex(ids[i]);
+		if (!v) {
+			delta->removed[removed++] = ids[i];
+			continue;
+		}
+		delta->nodes[nodei] = v->id;
+		delta->offsets[nodei++] = edgei;
+		for (edge *head = v->head; head != NULL; head = head->next) delta->neighbors[edgei++] = head->b;
+	}
+	delta->offsets[nodei] = edgei;
+	delta->n_removed = removed;
+	return 1;
+}
+
+// Frees the adjacency list of v, returns how many edges it had
+static uint64_t drop_edges(vertex *v){
+	uint64_t degree = 0;
+	while (v->head){
+		edge *next = v->head->next;
+		free_edge(v->head);
+		v->head = next;
+		degree++;
+	}
+	return degree;
+}
+
+int apply_delta(checkpoint_area * delta){
+	// every edge that changed has both ends in the delta, so lists are replaced without touching
+	// other vertices, and the degrees gained and lost count each changed edge twice
+	int64_t change = 0;
+	uint64_t i;
+	for (i = 0; i < delta->n_removed; i++){
+		vertex *v = ret_vertex(delta->removed[i]);
+		if (!v) continue;
+		change -= drop_edges(v);
+		remove_vertex(v->id);
+	}
+	for (i = 0; i < delta->nsize; i++){
+		add_vertex(delta->nodes[i]);
+		vertex *v = ret_vertex(delta->nodes[i]);
+		change -= drop_edges(v);
+		for (uint64_t e = delta->offsets[i + 1]; e > delta->offsets[i]; e--) LL_insert(&(v->head), delta->neighbors[e - 1]);
+		change += delta->offsets[i + 1] - delta->offsets[i];
+	}
+	if (change % 2) return 0;
+	map.esize += change / 2;
+	return 1;
+}
@@ -19,14 +19,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 /*
 	Hashtable API prototypes
 */
 
-// Size of hashtable
+// Default number of hashtable buckets
 #define SIZE (100000)
 
 // Queue for doing BFS and tracking nodes
@@ -53,22 +55,25 @@ typedef struct vertex {
 	edge* head; 		// linked list of edges
 	struct vertex* next;	// for chaining
 	int path;
-	int visited;
+	int dirty;		// listed as changed since the last checkpoint
 } vertex;
 
 // Vertex hashtable definition
 typedef struct vertex_map {
 	vertex** table;
+	size_t capacity;	// number of buckets
 	size_t nsize;
 	size_t esize;
 } vertex_map;
 
 // Returns hash value
-int hash_vertex(uint64_t id);
+size_t hash_vertex(uint64_t id);
 // return true if vertices the same 
 bool same_vertex(uint64_t a, uint64_t b);
 // returns pointer to vertex, or NULL if it doesn't exist
 vertex * ret_vertex(uint64_t id);
+// grows hashtable to at least n buckets, returns false if they cannot be allocated
+bool reserve_vertices(size_t n);
 // adds vertex, returns false is vertex existed
 bool add_vertex(uint64_t id);
 // helper, returns false if vertex does not exist
@@ -128,13 +133,24 @@ uint64_t *get_neighbors(uint64_t id, int* n);
 */
 
 // Sizes in bytes
-#define SUPERBLOCK (20)
+#define SUPERBLOCK (4096)
+#define SUPERBLOCK_V1 (20)
 #define LOG_ENTRY_BLOCK (4096)
 #define LOG_ENTRY_HEADER (16)
 #define LOG_ENTRY (20)
 #define LOG_SIZE (2147483648)
 #define N_ENTRIES (204) // (4096 - 16) / 20 = 204
-#define MAX_BLOCKS (542287) // (2147483648 - 20) / 4096 = 542287
+#define MAX_BLOCKS (524287) // (2147483648 - 4096) / 4096 = 524287, same for v1's 20B superblock
+
+// On-disk layouts: v1 packs the log right after a 20B superblock, v2 aligns everything to 4KB
+#define LAYOUT_V1 (1)
+#define LAYOUT_V2 (2)
+#define SUPERBLOCK_MAGIC (0x32766870617267ULL) // "graphv2"
+
+// Durability levels: never flush, flush on a time/size window, flush before acknowledging
+#define DURABILITY_NONE (0)
+#define DURABILITY_BATCH (1)
+#define DURABILITY_STRICT (2)
 
 // op-codes for log entries
 #define ADD_NODE (0)
@@ -142,12 +158,23 @@ uint64_t *get_neighbors(uint64_t id, int* n);
 #define REMOVE_NODE (2)
 #define REMOVE_EDGE (3)
 
-// Definition of a 20B superblock
+// op-codes only understood by the binary protocol
+#define GET_NODE (4)
+#define GET_EDGE (5)
+#define GET_NEIGHBORS (6)
+#define SHORTEST_PATH (7)
+#define CHECKPOINT (8)
+
+// Definition of the superblock: v1 stores the first 20B, v2 a whole zero-padded 4KB block
 typedef struct superblock {
         uint64_t checksum;
         uint32_t generation;
-        uint32_t log_start;
+        uint32_t log_start;	// first log block, in 4KB blocks
         uint32_t log_size;
+        uint32_t version;	// v2 only
+        uint64_t magic;		// v2 only
+        uint32_t checkpoint_deltas;	// deltas after the base checkpoint, v2 only
+        uint32_t checkpoint_slot;	// slot of the checkpoint area holding the base, v2 only
 } superblock;
 
 // Definition of a 20B log entry
@@ -172,27 +199,129 @@ uint64_t checksum_superblock(void *bytes);
 uint64_t checksum_log_entry_block(void *bytes);
 // Writes superblock sup to disk
 size_t write_superblock(superblock* sup);
-// Returns true if checksum is equal to the XOR of all 8-byte words in superblock
+// Returns true if block is a v2 superblock and checksum is equal to the XOR of all its 8-byte words
 bool valid_superblock(superblock *block, uint64_t checksum);
+// Returns true if checksum matches block read as a v1 superblock
+bool valid_superblock_v1(superblock *block, uint64_t checksum);
+// Opens devfile for log I/O, with O_DIRECT where the filesystem supports it, returns false on failure
+bool open_log(const char *devfile);
 // Returns true if checksum is equal to the XOR of all 8-byte words in log entry block
 bool valid_log_entry_block(void *block, uint64_t checksum);
 // Implements -f (fomrat) functionality, returns true upon success
 bool format_superblock();
-// Reads the superblock, checks if it is valid, returns true upon success
+// Reads the superblock, checks if it is valid (v2, or v1 to be migrated), returns true upon success
 bool normal_startup();
-// Writes superblock with incremented generation number upon chckpoint
-bool update_superblock();
-// Returns number of log entry block that should be written next
+// Writes superblock for the log of the current generation, starting at block start
+bool update_superblock(uint32_t start);
+// Returns number of log entry block that should be written next, counted from log_start
 uint32_t get_tail();
-// Appends most recent mutating command to log, returns true on success
+// Starts an empty resident tail block of the current generation
+void reset_tail_block();
+// Makes block, read from the log at tail, the resident tail block if it belongs to this generation
+void load_tail_block(char *block);
+// Stages most recent mutating command for the next group commit, returns true on success
 bool add_to_log(uint32_t opcode, uint64_t arg1, uint64_t arg2);
-// Plays forward all 20B entries present in block
-void play_log_forward(char *block, uint32_t entries);
+// Returns number of 20B entries that still fit in the log segment, counting staged ones as used
+uint64_t log_room();
+// Stages n entries for the next group commit, returns false if the log cannot take them
+bool stage_log_entries(log_entry *entries, uint32_t n);
+// Writes every staged entry to the log at once, flushing it under strict durability
+void commit_log();
+// Flushes everything written to the device so far
+void sync_log();
+// Flushes the log if the batch durability window has passed, now in seconds
+void sync_log_if_due(double now);
+// Applies a mutating log entry to the in-memory graph, returns 200, 204 or 400
+int apply_log_entry(log_entry *entry);
+
+/*
+	Log writer API
+*/
+
+// Log writers: pwrite on the event loop, io_uring with writes in flight, or a thread of their own
+#define LOG_WRITER_SYNC (0)
+#define LOG_WRITER_URING (1)
+#define LOG_WRITER_THREAD (2)
+
+// Starts the log writer kind, returns false if it is not available here
+bool log_writer_start(int kind);
+// Writes length bytes of buf at offset, flushing them first if sync; takes ownership of buf.
+// An ordered write rewrites the last block of the previous one and must not overtake it; synced
+// writes complete in submission order.
+void log_writer_submit(char *buf, size_t length, off_t offset, bool sync, bool ordered);
+// Collects finished writes, waiting for at least one if wait and any are in flight
+void log_writer_reap(bool wait);
+// Returns a descriptor that turns readable as writes complete, or -1 for the sync writer
+int log_writer_notify_fd();
+
+/*
+	Log replay API
+*/
+
+// Startup reads the log in chunks of 1024 blocks (4 MB), this many ahead of the replay
+#define REPLAY_CHUNK_BLOCKS (1024)
+#define REPLAY_CHUNKS (8)
+// Most threads verifying and decoding chunks while the replay applies earlier ones
+#define REPLAY_WORKERS (4)
+
+// Starts reading the circular log of max_blocks blocks at base from in, from block start
+// on, for a log that begins in generation gen
+void log_reader_start(int in, off_t base, uint32_t start, uint32_t max_blocks, uint32_t gen);
+// Returns the next 4KB log block, valid until the next call, or NULL past the end of what could be read.
+// Sets valid to whether its checksum matches and, if it does, entries to its decoded entries.
+char* log_reader_next(bool *valid, log_entry **entries);
+// Stops the reader and the workers and frees their buffers
+void log_reader_stop();
+
+// Replay modes: apply every entry in order, or fold the log into its net effect first
+#define REPLAY_SEQUENTIAL (0)
+#define REPLAY_COMPACT (1)
+
+// Folds one log entry into the final states
+void compact_log_entry(log_entry *entry);
+// Applies the net effect of every entry folded in, returns the number of operations applied
+uint64_t compact_apply();
 
 #define CHECKPOINT_HEADER (16)
 #define CHECKPOINT_NODE (8)
 #define CHECKPOINT_EDGE (16)
 #define CHECKPOINT_AREA (8589934592)
+// The area has two slots of 4 GB; a full checkpoint goes to the one not in use, and the superblock
+// write that starts the new generation also switches to it
+#define CHECKPOINT_SLOT (CHECKPOINT_AREA / 2)
+
+// Checkpoint formats: v1 is a node array and a list of edge pairs; v2 starts with a magic number
+// and stores the nodes sorted by id, then each node's first neighbor, then all neighbors in node order
+#define CHECKPOINT_V1 (1)
+#define CHECKPOINT_V2 (2)
+#define CHECKPOINT_MAGIC (0x3270636870617267)	// "graphcp2"
+#define CHECKPOINT_HEADER_V2 (24)	// magic, nsize, esize
+#define CHECKPOINT_OFFSET (8)
+#define CHECKPOINT_NEIGHBOR (8)
+// v3 compresses v2 into blocks of nodes that decode independently, found through an index after the
+// header. Each node is its id's gap from the previous node of the block, its degree, its first
+// neighbor's zigzagged distance from it and the gaps between its sorted neighbors, all as varints.
+#define CHECKPOINT_V3 (3)
+#define CHECKPOINT_MAGIC_V3 (0x3370636870617267)	// "graphcp3"
+#define CHECKPOINT_HEADER_V3 (32)	// magic, nsize, esize, number of blocks
+#define CHECKPOINT_BLOCK_NODES (4096)
+#define CHECKPOINT_INDEX (16)	// per block and one past the last: offset into the data, first neighbor
+// v4 is v3 with a CRC32C in each index entry: of the block's data, padding included, and in the entry
+// past the last, of everything before it from the start of the header
+#define CHECKPOINT_V4 (4)
+#define CHECKPOINT_MAGIC_V4 (0x3470636870617267)	// "graphcp4"
+#define CHECKPOINT_INDEX_V4 (24)	// offset into the data, first neighbor, CRC32C
+// A delta checkpoint follows the base or the delta before it, on the next whole block. Its header is
+// followed by the ids of the vertices removed, an index and v3 blocks of the vertices changed; the
+// index of one with the checksummed magic has v4 entries. Its tag is kept clear of the format versions
+#define CHECKPOINT_DELTA (100)
+#define CHECKPOINT_MAGIC_DELTA (0x6470636870617267)	// "graphcpd"
+#define CHECKPOINT_MAGIC_DELTA_V4 (0x6570636870617267)	// "graphcpe"
+#define CHECKPOINT_HEADER_DELTA (48)	// magic, number, nodes, neighbors, blocks, removed vertices
+// Most threads flattening, encoding or decoding a checkpoint at once
+#define CHECKPOINT_WORKERS (4)
+// Checkpoint data is written 8 MB at a time
+#define CHECKPOINT_BUFFER (8 << 20)
 
 // Definition of edge for checkpoint area
 typedef struct mem_edge {
@@ -205,20 +334,108 @@ typedef struct checkpoint_area{
 	uint64_t nsize;
 	uint64_t esize;
 	uint64_t *nodes;
-	struct mem_edge *edges;
+	struct mem_edge *edges;	// v1
+	uint64_t *offsets;	// v2 to v4: nsize + 1 of them, node i's neighbors are [offsets[i], offsets[i + 1])
+	uint64_t *neighbors;	// v2 to v4: both directions of every edge, 2 * esize of them; a delta's
+				// vertices' neighbors, offsets[nsize] of them
+	uint64_t *removed;	// delta: vertices removed
+	uint64_t n_removed;
+	uint64_t bytes;		// size on disk, for one loaded
+	int version;		// CHECKPOINT_V1 to CHECKPOINT_V4, or CHECKPOINT_DELTA
 }checkpoint_area;
 
-// Returns a checkpoint_area struct representing the checkpointed map
-checkpoint_area *get_checkpoint();
+// Returns the size on disk of a checkpoint of version with nsize nodes and esize edges; for v3 and
+// v4, the least it can take
+uint64_t checkpoint_size(int version, uint64_t nsize, uint64_t esize);
 
-// Makes a checkpoint_area struct of the current in-memory map
+// Returns a checkpoint_area struct representing the checkpointed map, mapped read-only from fd
+checkpoint_area *get_checkpoint(int fd, off_t at);
+
+// Unmaps a checkpoint returned by get_checkpoint
+void put_checkpoint(struct checkpoint_area * loaded);
+
+// Makes a v2 checkpoint_area struct of the current in-memory map, its nodes in id order within each of
+// the ranges of the table the work is split into
 int make_checkpoint(struct checkpoint_area * flat_graph);
+// Makes a delta checkpoint_area struct of the n vertices ids, allocating its arrays: those still in
+// the map with all their neighbors, the others as removed
+int make_delta(struct checkpoint_area * delta, uint64_t *ids, uint64_t n);
+// Applies delta to the map, returns 0 if it does not fit it
+int apply_delta(struct checkpoint_area * delta);
+// Hands over the sorted ids of the vertices changed since the last call, returns how many there are
+uint64_t take_dirty(uint64_t **ids);
+// Lists the n ids handed over by take_dirty as changed again
+void restore_dirty(uint64_t *ids, uint64_t n);
+// Builds the graph from the checkpoint base and deltas on fd, returns false if a delta is corrupt
+bool load_checkpoint(int fd);
+
+// Returns the number of threads checkpoint work is split across
+int checkpoint_workers();
+// Runs work(i, n) for every i below n, each on a thread of its own but the first, and waits for them all
+void run_workers(void (*work)(int, int), int n);
+
+// Background checkpoints: the event loop copies the graph for a thread to write, or a forked
+// process writes its copy-on-write view of it
+#define CHECKPOINT_COPY (0)
+#define CHECKPOINT_FORK (1)
 
-//Writes checkpoint to disk and updates superblock generation
-int docheckpoint(struct checkpoint_area * new);
+//Writes checkpoint to disk and updates superblock generation, returns false if it does not fit
+bool docheckpoint();
 
-// Updates the in-memory map from the checkpointed map stored in disk
+// Starts checkpointing the graph in the background while the log goes on in the next generation, or
+// queues one for when the running one is done; returns false if it does not fit the checkpoint area
+bool checkpoint_start();
+
+// Completes the background checkpoint once written, waiting for it if wait; returns true if none is left running
+bool finish_checkpoint(bool wait);
+
+// Returns true if a checkpoint is queued or the log is full enough that a background one should start
+bool checkpoint_due();
+
+// Updates the in-memory map from the checkpointed map stored in disk, returns 0 if the result does
+// not have the checkpoint's node and edge counts
 int buildmap(struct checkpoint_area * loaded);
 
 // effectively clears the checkpoint area on a format
 int clear_checkpoint_area();
+
+/*
+	Command API, shared by the HTTP and binary protocols
+*/
+
+// Adds node id and logs it, returns 200, 204 or 507
+int cmd_add_node(uint64_t id);
+// Adds edge a-b and logs it, returns 200, 204, 400 or 507
+int cmd_add_edge(uint64_t a, uint64_t b);
+// Removes node id and logs it, returns 200, 400 or 507
+int cmd_remove_node(uint64_t id);
+// Removes edge a-b and logs it, returns 200, 400 or 507
+int cmd_remove_edge(uint64_t a, uint64_t b);
+// Sets in_graph to whether node id exists, returns 200
+int cmd_get_node(uint64_t id, bool *in_graph);
+// Sets in_graph to whether edge a-b exists, returns 200 or 400
+int cmd_get_edge(uint64_t a, uint64_t b, bool *in_graph);
+// Sets neighbors to a malloced array of size n, returns 200 or 400
+int cmd_get_neighbors(uint64_t id, uint64_t **neighbors, int *n);
+// Sets distance to the shortest path from a to b, returns 200, 204 or 400
+int cmd_shortest_path(uint64_t a, uint64_t b, int *distance);
+// Starts checkpointing the graph in the background, returns 200 or 507
+int cmd_checkpoint();
+
+/*
+	Binary protocol
+*/
+
+// Every frame starts with a 4B length of the payload that follows
+#define BIN_FRAME_HEADER (4)
+// Request payload: one 20B record laid out like a log entry
+#define BIN_REQUEST (LOG_ENTRY)
+// Response: 4B status, 4B count of trailing ids, 8B value
+#define BIN_RESPONSE (16)
+
+// Definition of a 16B binary response header
+typedef struct bin_response {
+	uint32_t status;
+	uint32_t count;
+	uint64_t value;
+} bin_response;
@@ -0,0 +1,249 @@
+/*
+ * logwriter.c
+ *
+ * by Stylianos Rousoglou
+ * and Alex Saiontz
+ *
+ * Provides the log writers that put group
+ * commits on the device: plain pwrite, io_uring
+ * with several writes in flight, or a thread
+ * of its own
+ */
+
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include "headers.h"
+
+// Commit writes handed to the writer, and those complete with every earlier one
+uint64_t log_writes_issued;
+uint64_t log_writes_done;
+
+int log_writer = LOG_WRITER_SYNC;	// writer chosen at startup
+
+extern int log_fd;
+
+// Most commit writes in flight at once; a submit waits for the oldest beyond this
+#define MAX_INFLIGHT (64)
+
+// One commit write in flight
+typedef struct inflight_write {
+	char *buf;	// blocks being written, freed on completion
+	size_t length;
+	off_t offset;
+	bool sync;	// flush after writing
+	bool done;
+} inflight_write;
+
+// Minimal io_uring, driven with raw system calls
+typedef struct uring {
+	int fd;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+} uring;
+
+static uring ring;
+static int uring_event = -1;	// eventfd the kernel bumps for every completion it posts
+static inflight_write inflight[MAX_INFLIGHT];
+
+// Writer thread state; inflight doubles as its single-producer single-consumer queue
+static int wakeup_fd = -1;	// eventfd the event loop bumps after queueing a write
+static int notify[2] = { -1, -1 };	// socket pair the thread writes to after each write
+static uint64_t thread_written;	// writes the thread has finished, in order
+
+// Writes every queued commit, in order, sleeping on wakeup_fd while the queue is empty
+static void* writer_thread(void *arg) {
+	uint64_t seq = 0;
+	uint64_t counter;
+	for (;;) {
+		while (seq == __atomic_load_n(&log_writes_issued, __ATOMIC_ACQUIRE)) {
+			if (read(wakeup_fd, &counter, sizeof(counter)) != sizeof(counter) && errno != EINTR) exit(2);
+		}
+		inflight_write *w = &inflight[++seq % MAX_INFLIGHT];
+		if (pwrite(log_fd, w->buf, w->length, w->offset) != w->length) exit(2);
+		if (w->sync && fdatasync(log_fd)) exit(2);
+		__atomic_store_n(&thread_written, seq, __ATOMIC_RELEASE);
+		// the event loop wakes on this; a full socket already has a wakeup pending
+		char byte = 0;
+		if (send(notify[1], &byte, 1, MSG_DONTWAIT) < 0 && errno != EAGAIN) exit(2);
+	}
+	return NULL;
+}
+
+// Starts the writer thread, returns false on failure
+static bool thread_setup() {
+	pthread_t thread;
+	wakeup_fd = eventfd(0, 0);
+	if (wakeup_fd == -1 || socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, notify)) return false;
+	if (pthread_create(&thread, NULL, writer_thread, NULL)) return false;
+	pthread_detach(thread);
+	return true;
+}
+
+// Sets up ring with room for every write in flight and its fdatasync, its completions signalled on
+// uring_event, returns false on failure
+static bool uring_setup() {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	ring.fd = syscall(__NR_io_uring_setup, 2 * MAX_INFLIGHT, &p);
+	if (ring.fd < 0) return false;
+
+	size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+	if (single && cq_size > sq_size) sq_size = cq_size;
+
+	char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) return false;
+	char *cq = single ? sq : mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+	if (cq == MAP_FAILED) return false;
+	ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED) return false;
+
+	ring.sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	ring.sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *) (sq + p.sq_off.array);
+	ring.cq_head = (unsigned *) (cq + p.cq_off.head);
+	ring.cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	ring.cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	uring_event = eventfd(0, EFD_NONBLOCK);
+	return uring_event != -1 && !syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_EVENTFD, &uring_event, 1);
+}
+
+// Returns the next free submission entry, zeroed; the kernel consumes them on every enter
+static struct io_uring_sqe* uring_sqe() {
+	unsigned tail = *ring.sq_tail;
+	unsigned index = tail & *ring.sq_mask;
+	struct io_uring_sqe *sqe = &ring.sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring.sq_array[index] = index;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+// Submits n queued entries and waits for at least wait completions
+static void uring_enter(unsigned n, unsigned wait) {
+	int ret;
+	do {
+		ret = syscall(__NR_io_uring_enter, ring.fd, n, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0) exit(2);
+}
+
+// Starts the log writer kind, returns false if it is not available here
+bool log_writer_start(int kind) {
+	if (kind == LOG_WRITER_URING && !uring_setup()) return false;
+	if (kind == LOG_WRITER_THREAD && !thread_setup()) return false;
+	log_writer = kind;
+	return true;
+}
+
+// Writes length bytes of buf at offset, flushing them first if sync; takes ownership of buf.
+// An ordered write rewrites the last block of the previous one and must not overtake it. Synced
+// writes complete in order with every writer, so the device never holds a group commit without
+// every earlier one: recovery stops at the first invalid block, and a later block past such a hole
+// would be replayed once new commits filled the hole.
+void log_writer_submit(char *buf, size_t length, off_t offset, bool sync, bool ordered) {
+	uint64_t seq = log_writes_issued + 1;
+
+	if (log_writer == LOG_WRITER_SYNC) {
+		if (pwrite(log_fd, buf, length, offset) != length) exit(2);
+		if (sync && fdatasync(log_fd)) exit(2);
+		free(buf);
+		log_writes_issued = log_writes_done = seq;
+		return;
+	}
+
+	// reuse of a slot waits for the write that held it
+	while (seq - log_writes_done > MAX_INFLIGHT) log_writer_reap(true);
+	inflight[seq % MAX_INFLIGHT].buf = buf;
+	inflight[seq % MAX_INFLIGHT].length = length;
+	inflight[seq % MAX_INFLIGHT].offset = offset;
+	inflight[seq % MAX_INFLIGHT].sync = sync;
+	inflight[seq % MAX_INFLIGHT].done = false;
+
+	if (log_writer == LOG_WRITER_THREAD) {
+		// publishing the slot hands it to the thread; it writes in order, so nothing needs ordering here
+		uint64_t one = 1;
+		__atomic_store_n(&log_writes_issued, seq, __ATOMIC_RELEASE);
+		if (write(wakeup_fd, &one, sizeof(one)) != sizeof(one)) exit(2);
+		return;
+	}
+	log_writes_issued = seq;
+
+	// user_data is the sequence number, then a bit for the fdatasync and one for the last entry of the write
+	struct io_uring_sqe *sqe = uring_sqe();
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = log_fd;
+	sqe->addr = (uint64_t) (uintptr_t) buf;
+	sqe->len = length;
+	sqe->off = offset;
+	sqe->user_data = (seq << 2) | !sync;
+	// a synced write and its fdatasync only start once every earlier write is done; unsynced ones
+	// reach the device in no particular order with any writer
+	if ((sync || ordered) && seq - 1 > log_writes_done) sqe->flags |= IOSQE_IO_DRAIN;
+	if (sync) {
+		sqe->flags |= IOSQE_IO_LINK;
+		sqe = uring_sqe();
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fd = log_fd;
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		sqe->user_data = (seq << 2) | 3;
+	}
+	uring_enter(sync ? 2 : 1, 0);
+}
+
+// Collects finished writes, waiting for at least one if wait and any are in flight
+void log_writer_reap(bool wait) {
+	if (log_writer == LOG_WRITER_SYNC || log_writes_done == log_writes_issued) return;
+
+	if (log_writer == LOG_WRITER_THREAD) {
+		uint64_t written;
+		while ((written = __atomic_load_n(&thread_written, __ATOMIC_ACQUIRE)) == log_writes_done && wait) {
+			// the thread sends a byte after publishing each write, so the load above sees any write whose
+			// byte is drained here
+			struct pollfd p = { notify[0], POLLIN, 0 };
+			if (poll(&p, 1, -1) < 0 && errno != EINTR) exit(2);
+			char bytes[64];
+			while (read(notify[0], bytes, sizeof(bytes)) > 0);
+		}
+		for (; log_writes_done < written; log_writes_done++) {
+			free(inflight[(log_writes_done + 1) % MAX_INFLIGHT].buf);
+			inflight[(log_writes_done + 1) % MAX_INFLIGHT].buf = NULL;
+		}
+		return;
+	}
+
+	if (wait) uring_enter(0, 1);
+
+	unsigned head = *ring.cq_head;
+	unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+		uint64_t seq = cqe->user_data >> 2;
+		inflight_write *w = &inflight[seq % MAX_INFLIGHT];
+		// a failed or short write is as fatal as it is for pwrite
+		if (cqe->res < 0 || (!(cqe->user_data & 2) && cqe->res != w->length)) exit(2);
+		if (cqe->user_data & 1) w->done = true;
+	}
+	__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+	// writes count as done in submission order
+	while (log_writes_done < log_writes_issued && inflight[(log_writes_done + 1) % MAX_INFLIGHT].done) {
+		log_writes_done++;
+		free(inflight[log_writes_done % MAX_INFLIGHT].buf);
+		inflight[log_writes_done % MAX_INFLIGHT].buf = NULL;
+	}
+}
+
+// Returns a descriptor that turns readable as writes complete, or -1 for the sync writer, which has none in flight
+int log_writer_notify_fd() {
+	return log_writer == LOG_WRITER_URING ? uring_event : notify[0];
+}
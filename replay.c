@@ -0,0 +1,394 @@
+/*
+ * replay.c
+ *
+ * by Stylianos Rousoglou
+ * and Alex Saiontz
+ *
+ * Provides the log reader used at startup: a
+ * thread reads the log in large sequential
+ * chunks, worker threads verify and decode
+ * them, and the replay consumes them in order,
+ * applying them one by one or compacted
+ */
+
+#include <pthread.h>
+#include "headers.h"
+
+extern vertex_map map;	// hashtable storing the graph
+
+// Stages a chunk goes through, in order
+#define CHUNK_EMPTY (0)	// free for the reader
+#define CHUNK_READ (1)	// read, waiting for a worker
+#define CHUNK_VERIFYING (2)	// taken by a worker
+#define CHUNK_READY (3)	// verified and decoded, waiting for the replay
+
+// One chunk of the log read ahead of the replay
+typedef struct log_chunk {
+	char *buf;
+	uint32_t n;	// blocks read into buf
+	int state;
+	bool *valid;	// per block: checksum matches
+	log_entry *entries;	// per block: N_ENTRIES slots of decoded entries
+} log_chunk;
+
+// State shared by the reader thread, the workers and the replay
+typedef struct log_reader {
+	int in;
+	off_t base;
+	uint32_t start;	// block the log starts at
+	uint32_t max_blocks;	// blocks in the circular log region
+	uint32_t generation;
+	log_chunk chunks[REPLAY_CHUNKS];
+	uint64_t read;	// chunks read so far
+	uint64_t verify;	// chunk the workers take next
+	uint64_t next;	// chunk the replay takes next, counted from the start
+	uint32_t used;	// blocks the replay has taken from it
+	bool stop;
+	bool finished;	// the reader thread has read all it will
+	pthread_t thread;
+	pthread_t workers[REPLAY_WORKERS];
+	int n_workers;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+} log_reader;
+
+static log_reader reader;
+
+// Returns true if the 4KB block ends the log: not a valid block, or one older than the log.
+// A partly filled block does not, since a later generation may follow it.
+static bool ends_log(char *block) {
+	log_entry_block_header *header = (log_entry_block_header *) block;
+	return !valid_log_entry_block(block, header->checksum) || header->generation < reader.generation;
+}
+
+// Sets the state of chunk and wakes everyone waiting on a state change
+static void set_state(log_chunk *chunk, int state) {
+	pthread_mutex_lock(&reader.lock);
+	chunk->state = state;
+	pthread_cond_broadcast(&reader.changed);
+	pthread_mutex_unlock(&reader.lock);
+}
+
+// Reads the log chunk by chunk into free buffers until it ends or the replay stops it
+static void* reader_thread(void *arg) {
+	uint32_t block = 0;	// blocks read, counted from the start of the log
+	for (uint64_t i = 0; ; i++) {
+		log_chunk *chunk = &reader.chunks[i % REPLAY_CHUNKS];
+		pthread_mutex_lock(&reader.lock);
+		while (chunk->state != CHUNK_EMPTY && !reader.stop) pthread_cond_wait(&reader.changed, &reader.lock);
+		bool stop = reader.stop;
+		pthread_mutex_unlock(&reader.lock);
+		if (stop) break;
+
+		// a chunk stops where the circular region wraps around
+		uint32_t at = (reader.start + block) % reader.max_blocks;
+		uint32_t want = reader.max_blocks - block;
+		if (want > reader.max_blocks - at) want = reader.max_blocks - at;
+		if (want > REPLAY_CHUNK_BLOCKS) want = REPLAY_CHUNK_BLOCKS;
+		ssize_t got = want ? pread(reader.in, chunk->buf, (size_t) want * LOG_ENTRY_BLOCK, reader.base + (off_t) at * LOG_ENTRY_BLOCK) : 0;
+		uint32_t n = got > 0 ? got / LOG_ENTRY_BLOCK : 0;
+		block += n;
+
+		pthread_mutex_lock(&reader.lock);
+		chunk->n = n;
+		chunk->state = CHUNK_READ;
+		reader.read++;
+		pthread_cond_broadcast(&reader.changed);
+		pthread_mutex_unlock(&reader.lock);
+
+		// nothing past a block that ends the log is needed
+		if (n == 0 || n < want || ends_log(chunk->buf + (size_t) (n - 1) * LOG_ENTRY_BLOCK)) break;
+	}
+
+	pthread_mutex_lock(&reader.lock);
+	reader.finished = true;
+	pthread_cond_broadcast(&reader.changed);
+	pthread_mutex_unlock(&reader.lock);
+	return NULL;
+}
+
+// Checks the checksum of every block in chunk and decodes the entries of the valid ones
+static void verify_chunk(log_chunk *chunk) {
+	for (uint32_t i = 0; i < chunk->n; i++) {
+		char *block = chunk->buf + (size_t) i * LOG_ENTRY_BLOCK;
+		log_entry_block_header *header = (log_entry_block_header *) block;
+		chunk->valid[i] = valid_log_entry_block(block, header->checksum) && header->n_entries <= N_ENTRIES;
+		if (!chunk->valid[i]) continue;
+
+		// packed 20B records on disk, padded structs in memory
+		log_entry *entries = chunk->entries + (size_t) i * N_ENTRIES;
+		for (uint32_t e = 0; e < header->n_entries; e++) {
+			memcpy(&entries[e], block + LOG_ENTRY_HEADER + e * LOG_ENTRY, LOG_ENTRY);
+		}
+	}
+}
+
+// Verifies chunks in the order they were read, several workers at a time
+static void* worker_thread(void *arg) {
+	for (;;) {
+		pthread_mutex_lock(&reader.lock);
+		while (reader.verify == reader.read && !reader.finished && !reader.stop) {
+			pthread_cond_wait(&reader.changed, &reader.lock);
+		}
+		if (reader.verify == reader.read || reader.stop) {
+			pthread_mutex_unlock(&reader.lock);
+			return NULL;
+		}
+		log_chunk *chunk = &reader.chunks[reader.verify++ % REPLAY_CHUNKS];
+		chunk->state = CHUNK_VERIFYING;
+		pthread_mutex_unlock(&reader.lock);
+
+		verify_chunk(chunk);
+		set_state(chunk, CHUNK_READY);
+	}
+}
+
+// Starts reading the circular log of max_blocks blocks at base from in, from block start
+// on, for a log that begins in generation gen
+void log_reader_start(int in, off_t base, uint32_t start, uint32_t max_blocks, uint32_t gen) {
+	memset(&reader, 0, sizeof(reader));
+	reader.in = in;
+	reader.base = base;
+	reader.start = start;
+	reader.max_blocks = max_blocks;
+	reader.generation = gen;
+	for (int i = 0; i < REPLAY_CHUNKS; i++) {
+		log_chunk *chunk = &reader.chunks[i];
+		// aligned for O_DIRECT
+		if (posix_memalign((void **) &chunk->buf, LOG_ENTRY_BLOCK, REPLAY_CHUNK_BLOCKS * LOG_ENTRY_BLOCK)) exit(1);
+		chunk->valid = malloc(sizeof(bool) * REPLAY_CHUNK_BLOCKS);
+		chunk->entries = malloc(sizeof(log_entry) * REPLAY_CHUNK_BLOCKS * N_ENTRIES);
+		if (!chunk->valid || !chunk->entries) exit(1);
+	}
+	pthread_mutex_init(&reader.lock, NULL);
+	pthread_cond_init(&reader.changed, NULL);
+	if (pthread_create(&reader.thread, NULL, reader_thread, NULL)) exit(1);
+
+	// one worker per core the replay itself does not need; with none the replay verifies chunks itself
+	long cores = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+	reader.n_workers = cores > REPLAY_WORKERS ? REPLAY_WORKERS : (cores > 0 ? cores : 0);
+	for (int i = 0; i < reader.n_workers; i++) {
+		if (pthread_create(&reader.workers[i], NULL, worker_thread, NULL)) exit(1);
+	}
+}
+
+// Returns the next 4KB log block, valid until the next call, or NULL past the end of what could be read.
+// Sets valid to whether its checksum matches and, if it does, entries to its decoded entries.
+char* log_reader_next(bool *valid, log_entry **entries) {
+	log_chunk *chunk = &reader.chunks[reader.next % REPLAY_CHUNKS];
+	pthread_mutex_lock(&reader.lock);
+	if (chunk->state == CHUNK_READY && reader.used == chunk->n && chunk->n > 0) {
+		// hand the finished chunk back to the reader
+		chunk->state = CHUNK_EMPTY;
+		pthread_cond_broadcast(&reader.changed);
+		reader.next++;
+		reader.used = 0;
+		chunk = &reader.chunks[reader.next % REPLAY_CHUNKS];
+	}
+	// without workers, a chunk that has been read is verified here
+	while (chunk->state != CHUNK_READY && !(chunk->state == CHUNK_READ && reader.n_workers == 0)
+			&& !(reader.finished && reader.next == reader.read)) {
+		pthread_cond_wait(&reader.changed, &reader.lock);
+	}
+	bool verify = chunk->state == CHUNK_READ;
+	if (verify) chunk->state = CHUNK_READY;
+	bool ready = chunk->state == CHUNK_READY;
+	pthread_mutex_unlock(&reader.lock);
+	if (verify) verify_chunk(chunk);
+
+	if (!ready || reader.used == chunk->n) return NULL;
+	*valid = chunk->valid[reader.used];
+	*entries = chunk->entries + (size_t) reader.used * N_ENTRIES;
+	return chunk->buf + (size_t) reader.used++ * LOG_ENTRY_BLOCK;
+}
+
+// Stops the reader and the workers and frees their buffers
+void log_reader_stop() {
+	pthread_mutex_lock(&reader.lock);
+	reader.stop = true;
+	pthread_cond_broadcast(&reader.changed);
+	pthread_mutex_unlock(&reader.lock);
+	pthread_join(reader.thread, NULL);
+	for (int i = 0; i < reader.n_workers; i++) pthread_join(reader.workers[i], NULL);
+	for (int i = 0; i < REPLAY_CHUNKS; i++) {
+		free(reader.chunks[i].buf);
+		free(reader.chunks[i].valid);
+		free(reader.chunks[i].entries);
+	}
+	pthread_mutex_destroy(&reader.lock);
+	pthread_cond_destroy(&reader.changed);
+}
+
+/*
+	Compacting replay: the valid log prefix is folded into the final state
+	of every node and edge it touches, and only that net effect is applied
+*/
+
+// Final state of one node touched by the log
+typedef struct node_state {
+	uint64_t id;
+	uint64_t seq;		// position of its last add_node or remove_node
+	uint64_t removed;	// position of its last remove_node, 0 if none
+	uint32_t opcode;	// its last add_node or remove_node
+	bool existed;		// false if the log first added it, so it was not there before
+	bool used;
+} node_state;
+
+// Final state of one edge touched by the log, keyed with a < b
+typedef struct edge_state {
+	uint64_t a;
+	uint64_t b;
+	uint64_t seq;		// position of its last add_edge or remove_edge
+	uint32_t opcode;
+	bool existed;		// false if the log first added it, so it was not there before
+	bool used;
+} edge_state;
+
+// Open-addressing tables of everything the log touched
+static node_state *nodes;
+static edge_state *edges;
+static uint64_t nodes_size, n_nodes;
+static uint64_t edges_size, n_edges;
+static uint64_t compacted;	// entries folded in, counting from 1
+
+// Mixes the bits of x for table lookups
+static uint64_t mix(uint64_t x) {
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	return x ^ (x >> 33);
+}
+
+// Returns the state of node id, inserting an empty one if missing
+static node_state* node_slot(uint64_t id) {
+	if (2 * (n_nodes + 1) > nodes_size) {
+		// grow to keep the table at most half full
+		node_state *old = nodes;
+		uint64_t old_size = nodes_size;
+		nodes_size = nodes_size ? 2 * nodes_size : 1024;
+		nodes = calloc(nodes_size, sizeof(node_state));
+		if (!nodes) exit(1);
+		n_nodes = 0;
+		for (uint64_t i = 0; i < old_size; i++) {
+			if (old[i].used) *node_slot(old[i].id) = old[i];
+		}
+		free(old);
+	}
+	uint64_t i = mix(id) & (nodes_size - 1);
+	while (nodes[i].used && nodes[i].id != id) i = (i + 1) & (nodes_size - 1);
+	if (!nodes[i].used) {
+		nodes[i].used = true;
+		nodes[i].id = id;
+		n_nodes++;
+	}
+	return &nodes[i];
+}
+
+// Returns the state of edge a-b, inserting an empty one if missing
+static edge_state* edge_slot(uint64_t a, uint64_t b) {
+	if (a > b) {
+		uint64_t t = a;
+		a = b;
+		b = t;
+	}
+	if (2 * (n_edges + 1) > edges_size) {
+		edge_state *old = edges;
+		uint64_t old_size = edges_size;
+		edges_size = edges_size ? 2 * edges_size : 1024;
+		edges = calloc(edges_size, sizeof(edge_state));
+		if (!edges) exit(1);
+		n_edges = 0;
+		for (uint64_t i = 0; i < old_size; i++) {
+			if (old[i].used) *edge_slot(old[i].a, old[i].b) = old[i];
+		}
+		free(old);
+	}
+	uint64_t i = mix(a ^ mix(b)) & (edges_size - 1);
+	while (edges[i].used && (edges[i].a != a || edges[i].b != b)) i = (i + 1) & (edges_size - 1);
+	if (!edges[i].used) {
+		edges[i].used = true;
+		edges[i].a = a;
+		edges[i].b = b;
+		n_edges++;
+	}
+	return &edges[i];
+}
+
+// Folds one log entry into the final states
+void compact_log_entry(log_entry *entry) {
+	uint64_t seq = ++compacted;
+	node_state *node;
+	edge_state *edge;
+	switch (entry->opcode) {
+		case ADD_NODE:
+		case REMOVE_NODE:
+			node = node_slot(entry->node_a_id);
+			// only operations that succeeded are logged, so the first one tells what was there before
+			if (node->seq == 0) node->existed = entry->opcode == REMOVE_NODE;
+			node->seq = seq;
+			node->opcode = entry->opcode;
+			if (entry->opcode == REMOVE_NODE) node->removed = seq;
+			break;
+		case ADD_EDGE:
+		case REMOVE_EDGE:
+			edge = edge_slot(entry->node_a_id, entry->node_b_id);
+			if (edge->seq == 0) edge->existed = entry->opcode == REMOVE_EDGE;
+			edge->seq = seq;
+			edge->opcode = entry->opcode;
+			break;
+	}
+}
+
+// Returns the position of the last remove_node of id, 0 if the log never removed it
+static uint64_t removed_at(uint64_t id) {
+	if (nodes_size == 0) return 0;
+	uint64_t i = mix(id) & (nodes_size - 1);
+	while (nodes[i].used) {
+		if (nodes[i].id == id) return nodes[i].removed;
+		i = (i + 1) & (nodes_size - 1);
+	}
+	return 0;
+}
+
+// Applies the net effect of every entry folded in, returns the number of operations applied
+uint64_t compact_apply() {
+	uint64_t applied = 0;
+
+	// the number of nodes touched is known up front, so the hashtable is sized once; without the
+	// memory for that, the buckets it has just get longer chains
+	reserve_vertices(map.nsize + n_nodes);
+
+	// a removed node loses every edge it had before; later edges are re-added below.
+	// A node the log added first had nothing before it to lose.
+	for (uint64_t i = 0; i < nodes_size; i++) {
+		if (nodes[i].used && nodes[i].removed && nodes[i].existed) {
+			remove_vertex(nodes[i].id);
+			applied++;
+		}
+	}
+	for (uint64_t i = 0; i < nodes_size; i++) {
+		if (nodes[i].used && nodes[i].opcode == ADD_NODE) {
+			add_vertex(nodes[i].id);
+			applied++;
+		}
+	}
+
+	// an edge ends in the state of its last edge operation unless an endpoint was removed after it
+	for (uint64_t i = 0; i < edges_size; i++) {
+		edge_state *edge = &edges[i];
+		if (!edge->used || removed_at(edge->a) > edge->seq || removed_at(edge->b) > edge->seq) continue;
+		// an edge the log added and then removed again nets out to nothing
+		if (edge->opcode == REMOVE_EDGE && !edge->existed) continue;
+		if (edge->opcode == ADD_EDGE) add_edge(edge->a, edge->b);
+		else remove_edge(edge->a, edge->b);
+		applied++;
+	}
+
+	free(nodes);
+	free(edges);
+	nodes = NULL;
+	edges = NULL;
+	nodes_size = n_nodes = edges_size = n_edges = compacted = 0;
+	return applied;
+}
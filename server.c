@@ -14,9 +14,62 @@
 extern vertex_map map;// hashtable storing the graph
 extern uint32_t generation;  // in-memory generation number
 extern uint32_t tail;        // in-memory tail of the log
+extern uint32_t n_staged;    // log entries waiting for the next group commit
+extern uint64_t staged_total; // log entries staged since startup
+extern int durability;        // when log writes are flushed to the device
+extern double sync_interval; // seconds between flushes under batch durability
+extern uint64_t sync_bytes;  // bytes written that force a flush under batch durability
+extern uint64_t unsynced_bytes; // bytes written since the last flush
+extern double last_sync;     // time of the last flush
+extern int layout;           // on-disk layout found at startup
+extern uint64_t log_writes_issued; // commit writes handed to the log writer
+extern uint64_t log_writes_done;   // commit writes complete with every earlier one
+extern int log_writer;             // log writer chosen at startup
+extern int replay_mode;            // how the log is applied at startup
+extern double checkpoint_at;       // log fill ratio that starts a background checkpoint
+extern bool checkpointing;         // a checkpoint is being written in the background
+extern int checkpoint_mode;        // how the background checkpoint gets its snapshot
+extern uint64_t checkpoints_started; // checkpoints started since startup
+extern uint64_t checkpoints_done;    // checkpoints whose superblock has been written
+extern uint64_t checkpoint_requests; // checkpoint requests accepted since startup
+extern uint64_t checkpoint_bytes;    // size of the last checkpoint done, 0 if it did not fit
+extern bool checkpoint_was_delta;    // the last checkpoint done was a delta
+extern int checkpoint_deltas_max;    // deltas written before a full checkpoint is due
+extern double checkpoint_seconds;    // time from its snapshot until it was on the device
 
 int fd;
 
+// Limits that keep cheap requests fast under overload; 0 disables a limit
+typedef struct admission_state {
+  int max_expensive;      // expensive queries admitted per poll iteration; they run one after another,
+                          // so this bounds the work done before the loop polls again, not work in flight
+  size_t max_conn_send;   // bytes one connection may have waiting to be sent
+  size_t max_total_send;  // bytes all connections may have waiting to be sent
+  int expensive;          // expensive queries admitted this poll iteration
+  size_t send_total;      // bytes currently waiting to be sent
+} admission_state;
+
+static admission_state admission = { 32, 4 << 20, 64 << 20, 0, 0 };
+
+// Returns 503 if a request must be rejected to protect cheap requests, 0 otherwise
+static int admit(struct mg_connection *c, bool expensive) {
+  if (admission.max_conn_send && c->send_mbuf.len > admission.max_conn_send) return 503;
+  if (admission.max_total_send && admission.send_total > admission.max_total_send) return 503;
+  if (expensive) {
+    if (admission.max_expensive && admission.expensive >= admission.max_expensive) return 503;
+    admission.expensive++;
+  }
+  return 0;
+}
+
+// Starts a poll iteration: resets the expensive query budget and recounts unsent bytes
+static void admission_reset(struct mg_mgr *mgr) {
+  struct mg_connection *c;
+  admission.expensive = 0;
+  admission.send_total = 0;
+  for (c = mg_next(mgr, NULL); c != NULL; c = mg_next(mgr, c)) admission.send_total += c->send_mbuf.len;
+}
+
 // Responds to given connection with code and length bytes of body
 static void respond(struct mg_connection *c, int code, const int length, const char* body) {
   mg_send_head(c, code, length, "Content-Type: application/json");
@@ -101,274 +154,913 @@ char* make_neighbor_response(const char* key1, const char* key2, int key1_length
   return response;
 }
 
-// Event handler for request
-static void ev_handler(struct mg_connection *c, int ev, void *p) {
-  if (ev == MG_EV_HTTP_REQUEST) {
-    struct http_message *hm = (struct http_message *) p;
-    struct json_token* tokens = parse_json2(hm->body.p, hm->body.len);
-    char* endptr;
-    char* response;
-
-    const char* arg_id = "node_id";
-    const char* arg_a = "node_a_id";
-    const char* arg_b = "node_b_id";
-    struct json_token* find_id;
-    struct json_token* find_a;
-    struct json_token* find_b;
-    if (strncmp(hm->uri.p, "/api/v1/checkpoint", hm->uri.len)){
-    find_id = find_json_token(tokens, arg_id);
-    find_a = find_json_token(tokens, arg_a);
-    find_b = find_json_token(tokens, arg_b);
+// Returns the value token stored under key in object token obj, or NULL
+static struct json_token* object_value(struct json_token* obj, const char* key) {
+  struct json_token* t = obj + 1;
+  struct json_token* end = obj + 1 + obj->num_desc;
+  int key_length = strlen(key);
+  while (t < end) {
+    // t is a key, t + 1 its value
+    if (t->len == key_length && !strncmp(t->ptr, key, key_length)) return t + 1;
+    t += 2 + t[1].num_desc;
+  }
+  return NULL;
+}
+
+// Fills entry from one operation object of a batch, returns false if malformed
+static bool parse_batch_op(struct json_token* op, log_entry* entry) {
+  if (op->type != JSON_TYPE_OBJECT) return false;
+  struct json_token* name = object_value(op, "op");
+  if (name == NULL || name->type != JSON_TYPE_STRING) return false;
+
+  struct json_token* a;
+  struct json_token* b = NULL;
+  if (name->len == 8 && !strncmp(name->ptr, "add_node", 8)) entry->opcode = ADD_NODE;
+  else if (name->len == 8 && !strncmp(name->ptr, "add_edge", 8)) entry->opcode = ADD_EDGE;
+  else if (name->len == 11 && !strncmp(name->ptr, "remove_node", 11)) entry->opcode = REMOVE_NODE;
+  else if (name->len == 11 && !strncmp(name->ptr, "remove_edge", 11)) entry->opcode = REMOVE_EDGE;
+  else return false;
+
+  if (entry->opcode == ADD_NODE || entry->opcode == REMOVE_NODE) {
+    a = object_value(op, "node_id");
+  } else {
+    a = object_value(op, "node_a_id");
+    b = object_value(op, "node_b_id");
+    if (b == NULL || b->type != JSON_TYPE_NUMBER) return false;
+  }
+  if (a == NULL || a->type != JSON_TYPE_NUMBER) return false;
+
+  entry->node_a_id = strtoull(a->ptr, NULL, 10);
+  entry->node_b_id = b ? strtoull(b->ptr, NULL, 10) : 0;
+  return true;
+}
+
+// Applies an array of mutating operations in order and logs them with one append
+static void handle_batch(struct mg_connection *c, struct json_token* tokens) {
+  struct json_token* ops = find_json_token(tokens, "ops");
+  if (ops == NULL || ops->type != JSON_TYPE_ARRAY) {
+    badRequest(c);
+    return;
+  }
+
+  // count operations in array
+  int n = 0;
+  struct json_token* op;
+  for (op = ops + 1; op < ops + 1 + ops->num_desc; op += 1 + op->num_desc) n++;
+
+  log_entry* entries = malloc(sizeof(log_entry) * (n + 1));
+  int* codes = malloc(sizeof(int) * (n + 1));
+  uint64_t room = log_room();
+  uint32_t staged = 0;
+
+  op = ops + 1;
+  for (int i = 0; i < n; i++, op += 1 + op->num_desc) {
+    log_entry entry;
+    if (!parse_batch_op(op, &entry)) codes[i] = 400;
+    else if (staged == room) codes[i] = 507;
+    else if ((codes[i] = apply_log_entry(&entry)) == 200) entries[staged++] = entry;
+  }
+
+  // all successful operations reach the log in the same group commit
+  stage_log_entries(entries, staged);
+
+  // {"results":[ + "ddd," per op + ]} + \0
+  char* response = malloc(sizeof(char) * (13 + 4 * n + 3));
+  int length = sprintf(response, "{\"results\":[");
+  for (int i = 0; i < n; i++) length += sprintf(response + length, i ? ",%d" : "%d", codes[i]);
+  length += sprintf(response + length, "]}");
+  respond(c, 200, length, response);
+  free(response);
+  free(entries);
+  free(codes);
+}
+
+// Number of operations between two progress reports of an import
+#define IMPORT_PROGRESS (1 << 20)
+// Largest ?nodes= hint an import may size the hashtable for (1 GB of buckets)
+#define IMPORT_MAX_NODES (1 << 27)
+// Longest line an import accepts; an operation takes well under 100 bytes
+#define IMPORT_MAX_LINE (64 << 10)
+
+// State of one streaming import
+typedef struct import_state {
+  char* line;           // partial line carried over from the previous chunk
+  size_t line_length;
+  uint64_t applied;     // operations that changed the graph
+  uint64_t skipped;     // well-formed operations answered with 204 or 400
+  uint64_t invalid;     // lines that are not a valid operation
+  uint64_t rejected;    // operations refused because the log is full
+  uint64_t write;       // log write covering the entries staged so far, 0 if none
+  double start;
+} import_state;
+
+// End of a run of held responses and the commit write and checkpoint they wait for
+typedef struct held_mark {
+  size_t end;             // offset in held just past the run
+  uint64_t write;         // log write that must be done before the run is sent
+  uint64_t checkpoint;    // checkpoint that must be done before the run is sent
+  bool report;            // the run is followed by the response of the checkpoint request
+} held_mark;
+
+// Per-connection state, kept in the connection's user_data
+typedef struct conn_data {
+  import_state* import;   // streaming import in progress, if any
+  struct mbuf held;       // responses waiting for their group commit or checkpoint
+  held_mark* marks;       // runs of held, oldest first
+  int n_marks;
+  int marks_size;
+  bool pending;           // true if listed in pending_conns
+  bool report;            // the request just handled started a checkpoint it will report on
+  bool close_after;       // close once the last response is sent
+} conn_data;
+
+// Connections holding responses until their group commit
+static struct mg_connection** pending_conns;
+static int n_pending;
+static int pending_size;
+
+// Number of imports in progress; their entries are committed in large groups
+static int imports_active;
+
+// Seconds staged entries may wait for more to join their group commit
+static double commit_window;
+// Time the oldest staged entry was staged, 0 if none
+static double staged_since;
+
+// Returns the state of connection c, allocating it on first use
+static conn_data* conn(struct mg_connection *c) {
+  if (c->user_data == NULL) {
+    conn_data* data = calloc(1, sizeof(conn_data));
+    mbuf_init(&data->held, 0);
+    c->user_data = data;
+  }
+  return c->user_data;
+}
+
+// Holds the bytes queued on c after offset queued until write, the log write covering the entries the
+// request staged (0 if none), is done, until its checkpoint is done if it started one, or while earlier
+// responses on c are held
+static void hold_response(struct mg_connection *c, size_t queued, uint64_t write, bool checkpointed) {
+  conn_data* data = conn(c);
+  if (write > log_writes_done || checkpointed || data->pending) {
+    mbuf_append(&data->held, c->send_mbuf.buf + queued, c->send_mbuf.len - queued);
+    c->send_mbuf.len = queued;
+
+    // staged entries go out with the next write, a checkpoint is done once its superblock is written;
+    // anything else just waits its turn
+    held_mark last = data->n_marks > 0 ? data->marks[data->n_marks - 1] : (held_mark) { 0, 0, 0, false };
+    if (write < last.write) write = last.write;
+    uint64_t checkpoint = checkpointed ? checkpoints_started : last.checkpoint;
+    if (data->n_marks > 0 && last.write == write && last.checkpoint == checkpoint && !last.report && !data->report) {
+      data->marks[data->n_marks - 1].end = data->held.len;
+    } else {
+      if (data->n_marks == data->marks_size) {
+        data->marks_size = data->marks_size ? 2 * data->marks_size : 4;
+        data->marks = realloc(data->marks, sizeof(held_mark) * data->marks_size);
+      }
+      data->marks[data->n_marks].end = data->held.len;
+      data->marks[data->n_marks].write = write;
+      data->marks[data->n_marks].checkpoint = checkpoint;
+      data->marks[data->n_marks++].report = data->report;
     }
-    // Sanity check for endpoint length and body not empty
-    if (hm->uri.len < 16 || tokens == NULL) {
+    data->report = false;
+
+    if (!data->pending) {
+      if (n_pending == pending_size) {
+        pending_size = pending_size ? 2 * pending_size : 64;
+        pending_conns = realloc(pending_conns, sizeof(struct mg_connection*) * pending_size);
+      }
+      pending_conns[n_pending++] = c;
+      data->pending = true;
+    }
+  } else if (data->close_after) {
+    c->flags |= MG_F_SEND_AND_CLOSE;
+  }
+}
+
+// Returns true if request is for the streaming import endpoint
+static bool is_import(struct http_message *hm) {
+  return hm->uri.len >= 14 && !strncmp(hm->uri.p, "/api/v1/import", hm->uri.len);
+}
+
+// Starts an import on c, pre-sizing the hashtable from the "nodes" query variable; returns 0, or 413 if
+// the hint is over IMPORT_MAX_NODES and 503 if the buckets cannot be allocated
+static int import_begin(struct mg_connection *c, struct http_message *hm) {
+  char nodes[24];
+  if (mg_get_http_var(&hm->query_string, "nodes", nodes, sizeof(nodes)) > 0) {
+    unsigned long long n = strtoull(nodes, NULL, 10);
+    if (n > IMPORT_MAX_NODES) return 413;
+    if (!reserve_vertices(n)) return 503;
+  }
+
+  import_state* state = calloc(1, sizeof(import_state));
+  state->start = mg_time();
+  imports_active++;
+  conn(c)->import = state;
+  return 0;
+}
+
+// Applies one newline-delimited operation
+static void import_line(import_state* state, const char* line, size_t length) {
+  // skip blank lines
+  while (length > 0 && (line[length - 1] == '\r' || line[length - 1] == ' ')) length--;
+  if (length == 0) return;
+
+  log_entry entry;
+  struct json_token* tokens = parse_json2(line, length);
+  bool valid = tokens != NULL && parse_batch_op(tokens, &entry);
+  free(tokens);
+
+  if (!valid) state->invalid++;
+  else if (log_room() == 0) state->rejected++;
+  else if (apply_log_entry(&entry) != 200) state->skipped++;
+  else {
+    stage_log_entries(&entry, 1);
+    state->write = log_writes_issued + 1;
+    state->applied++;
+  }
+
+  uint64_t done = state->applied + state->skipped + state->invalid + state->rejected;
+  if (done % IMPORT_PROGRESS == 0) {
+    double elapsed = mg_time() - state->start;
+    fprintf(stderr, "Import: %" PRIu64 " operations in %.1f s (%.0f ops/s)\n", done, elapsed, done / elapsed);
+  }
+}
+
+// Applies every complete line in data, carrying the incomplete last line over; returns false, having
+// applied the lines before it, at a line longer than IMPORT_MAX_LINE
+static bool import_feed(import_state* state, const char* data, size_t length) {
+  const char* end = data + length;
+  const char* newline;
+
+  while ((newline = memchr(data, '\n', end - data)) != NULL) {
+    if (state->line_length + (newline - data) > IMPORT_MAX_LINE) return false;
+    if (state->line_length > 0) {
+      // complete the line started in an earlier chunk
+      state->line = realloc(state->line, state->line_length + (newline - data));
+      memcpy(state->line + state->line_length, data, newline - data);
+      import_line(state, state->line, state->line_length + (newline - data));
+      state->line_length = 0;
+    } else {
+      import_line(state, data, newline - data);
+    }
+    data = newline + 1;
+  }
+
+  if (data < end) {
+    // a line without its newline yet is only carried over up to the limit
+    if (state->line_length + (end - data) > IMPORT_MAX_LINE) return false;
+    state->line = realloc(state->line, state->line_length + (end - data));
+    memcpy(state->line + state->line_length, data, end - data);
+    state->line_length += end - data;
+  }
+  return true;
+}
+
+// Frees the import state of c; what it applied is already staged for the log
+static void import_end(struct mg_connection *c) {
+  import_state* state = conn(c)->import;
+  free(state->line);
+  free(state);
+  conn(c)->import = NULL;
+  imports_active--;
+}
+
+// Ends the import on c, if it got started, with a bodiless response of code, and closes the connection
+// once that is sent; what it applied so far stays staged for the log
+static void import_refuse(struct mg_connection *c, int code) {
+  if (conn(c)->import != NULL) import_end(c);
+  respond(c, code, 0, "");
+  conn(c)->close_after = true;
+}
+
+// Feeds the body received so far to the import and discards it
+static void import_chunk(struct mg_connection *c, struct http_message *hm) {
+  c->flags |= MG_F_DELETE_CHUNK;
+  // the rest of a refused import is dropped until the connection closes
+  if (conn(c)->close_after) return;
+  int code = conn(c)->import == NULL ? import_begin(c, hm) : 0;
+  if (code == 0 && !import_feed(conn(c)->import, hm->body.p, hm->body.len)) code = 413;
+  if (code != 0) {
+    size_t queued = c->send_mbuf.len;
+    import_refuse(c, code);
+    hold_response(c, queued, 0, false);
+  }
+}
+
+// Applies the rest of the import and responds with its totals and throughput; returns the log write
+// covering every entry the import staged, over all its chunks, or 0 if there is none
+static uint64_t import_finish(struct mg_connection *c, struct http_message *hm) {
+  if (conn(c)->close_after) return 0;
+  int code = conn(c)->import == NULL ? import_begin(c, hm) : 0;
+  if (code == 0 && !import_feed(conn(c)->import, hm->body.p, hm->body.len)) code = 413;
+  if (code != 0) {
+    import_refuse(c, code);
+    return 0;
+  }
+  import_state* state = conn(c)->import;
+  if (state->line_length > 0) import_line(state, state->line, state->line_length);
+  state->line_length = 0;
+
+  double elapsed = mg_time() - state->start;
+  uint64_t done = state->applied + state->skipped + state->invalid + state->rejected;
+  char response[256];
+  int length = sprintf(response, "{\"applied\":%" PRIu64 ",\"skipped\":%" PRIu64 ",\"invalid\":%" PRIu64
+      ",\"rejected\":%" PRIu64 ",\"seconds\":%.3f,\"ops_per_sec\":%.0f}",
+      state->applied, state->skipped, state->invalid, state->rejected, elapsed, elapsed > 0 ? done / elapsed : 0);
+  code = state->rejected ? 507 : 200;
+  uint64_t write = state->write;
+  import_end(c);
+
+  respond(c, code, length, response);
+  conn(c)->close_after = true;
+  return write;
+}
+
+// Responds with the size, write throughput and kind of the last checkpoint done, or 507 if it did not fit
+static void respond_checkpoint(struct mg_connection *c) {
+  char response[128];
+  if (checkpoint_bytes == 0) {
+    respond(c, 507, 0, "");
+    return;
+  }
+  int length = sprintf(response, "{\"bytes\":%" PRIu64 ",\"seconds\":%.3f,\"mb_per_sec\":%.1f,\"delta\":%s}", checkpoint_bytes,
+      checkpoint_seconds, checkpoint_seconds > 0 ? checkpoint_bytes / checkpoint_seconds / (1 << 20) : 0,
+      checkpoint_was_delta ? "true" : "false");
+  respond(c, 200, length, response);
+}
+
+// Sends every held response whose log entries have been written and checkpoint is done
+static void release_responses() {
+  for (int i = 0; i < n_pending; i++) {
+    struct mg_connection *c = pending_conns[i];
+    conn_data* data = conn(c);
+    int done = 0;
+    while (done < data->n_marks && data->marks[done].write <= log_writes_done
+        && data->marks[done].checkpoint <= checkpoints_done) done++;
+    if (done == 0) continue;
+
+    // a checkpoint response is made once the checkpoint is done, after the run it follows
+    size_t end = 0;
+    for (int m = 0; m < done; m++) {
+      mg_send(c, data->held.buf + end, data->marks[m].end - end);
+      end = data->marks[m].end;
+      if (data->marks[m].report) respond_checkpoint(c);
+    }
+    mbuf_remove(&data->held, end);
+    data->n_marks -= done;
+    for (int m = 0; m < data->n_marks; m++) {
+      data->marks[m] = data->marks[m + done];
+      data->marks[m].end -= end;
+    }
+
+    if (data->n_marks == 0) {
+      data->pending = false;
+      if (data->close_after) c->flags |= MG_F_SEND_AND_CLOSE;
+      pending_conns[i--] = pending_conns[--n_pending];
+    }
+  }
+}
+
+// Frees the state of a closing connection, dropping responses it can no longer receive
+static void conn_close(struct mg_connection *c) {
+  conn_data* data = c->user_data;
+  // an interrupted import still has what it applied staged for the log
+  if (data->import != NULL) import_end(c);
+  if (data->pending) {
+    for (int i = 0; i < n_pending; i++) {
+      if (pending_conns[i] == c) pending_conns[i] = pending_conns[--n_pending];
+    }
+  }
+  mbuf_free(&data->held);
+  free(data->marks);
+  free(data);
+  c->user_data = NULL;
+}
+
+// Entries staged before a group commit is forced even with no responses waiting (256 blocks)
+#define COMMIT_MAX (N_ENTRIES * 256)
+
+// Returns true if the staged log entries should be written now
+static bool commit_due(double now) {
+  if (n_staged == 0) return false;
+  if (n_staged >= COMMIT_MAX) return true;
+  // the writer thread writes one group at a time, so the next one grows until it is free
+  if (log_writer == LOG_WRITER_THREAD && log_writes_done < log_writes_issued) return false;
+  // imports nobody is waiting on keep filling large groups
+  if (n_pending == 0 && imports_active > 0) return false;
+  return now - staged_since >= commit_window;
+}
+
+// Returns how long the next poll may block without delaying a group commit, flush or completion, in milliseconds
+static int poll_timeout(double now) {
+  double left = 1;
+  if (n_staged > 0 && (n_pending > 0 || imports_active == 0)) left = staged_since + commit_window - now;
+  if (durability == DURABILITY_BATCH && unsynced_bytes > 0 && last_sync + sync_interval - now < left) {
+    left = last_sync + sync_interval - now;
+  }
+  // a finished background checkpoint is noticed within 10 ms
+  if (checkpointing && left > 0.01) left = 0.01;
+  return left > 0 ? (int) (left * 1000) + 1 : 0;
+}
+
+// Responds with code and, on success, a json body made by make_json_two for the edge a-b
+static void respond_edge(struct mg_connection *c, int code, uint64_t a, uint64_t b) {
+  if (code != 200) {
+    respond(c, code, 0, "");
+    return;
+  }
+  char* response = make_json_two("node_a_id", "node_b_id", 9, 9, a, b);
+  respond(c, 200, strlen(response), response);
+  free(response);
+}
+
+// Responds with code and, on success, a json body holding the node id
+static void respond_node(struct mg_connection *c, int code, uint64_t id) {
+  if (code != 200) {
+    respond(c, code, 0, "");
+    return;
+  }
+  char* response = make_json_one("node_id", 7, id);
+  respond(c, 200, strlen(response), response);
+  free(response);
+}
+
+// Returns true if request is an expensive query subject to admission control; like handle_request, it
+// matches whole paths
+static bool is_expensive_uri(struct http_message *hm) {
+  return !mg_vcmp(&hm->uri, "/api/v1/get_neighbors") || !mg_vcmp(&hm->uri, "/api/v1/shortest_path");
+}
+
+// Handles one admitted HTTP request, dispatching on the whole path
+static void handle_request(struct mg_connection *c, struct http_message *hm) {
+  struct json_token* tokens = parse_json2(hm->body.p, hm->body.len);
+  char* endptr;
+  char* response;
+
+  const char* arg_id = "node_id";
+  const char* arg_a = "node_a_id";
+  const char* arg_b = "node_b_id";
+  struct json_token* find_id;
+  struct json_token* find_a;
+  struct json_token* find_b;
+  if (mg_vcmp(&hm->uri, "/api/v1/checkpoint")){
+  find_id = find_json_token(tokens, arg_id);
+  find_a = find_json_token(tokens, arg_a);
+  find_b = find_json_token(tokens, arg_b);
+  }
+  // Sanity check for body not empty; paths are matched whole below, so a short one gets 400 there
+  if (tokens == NULL) {
+    badRequest(c);
+    return;
+  }
+  if (!mg_vcmp(&hm->uri, "/api/v1/batch")) {
+    handle_batch(c, tokens);
+  }
+  else if (!mg_vcmp(&hm->uri, "/api/v1/add_node")) {
+  // body does not contain expected key
+    if (find_id == 0) {
       badRequest(c);
       return;
     }
-    if (!strncmp(hm->uri.p, "/api/v1/add_node", hm->uri.len)) {     
+
+    // index of value
+    int index1 = argument_pos(tokens, arg_id);
+    uint64_t arg_int = strtoll(tokens[index1 + 1].ptr, &endptr, 10);
+
+    respond_node(c, cmd_add_node(arg_int), arg_int);
+  } 
+  else if (!mg_vcmp(&hm->uri, "/api/v1/add_edge")) {
+    // body does not contain expected keys
+    if (find_a == 0 || find_b == 0) {
+      badRequest(c);
+      return;
+    }
+
+    // index of values
+    int index1 = argument_pos(tokens, arg_a);
+    int index2 = argument_pos(tokens, arg_b);
+    uint64_t arg_a_int = strtoll(tokens[index1 + 1].ptr, &endptr, 10);
+    uint64_t arg_b_int = strtoll(tokens[index2 + 1].ptr, &endptr, 10);
+
+    respond_edge(c, cmd_add_edge(arg_a_int, arg_b_int), arg_a_int, arg_b_int);
+  } 
+  else if (!mg_vcmp(&hm->uri, "/api/v1/remove_node")) {
     // body does not contain expected key
-      if (find_id == 0) {
-        badRequest(c);
-        return;
-      }
+    if (find_id == 0) {
+      badRequest(c);
+      return;
+    }
 
-      // index of value
-      int index1 = argument_pos(tokens, arg_id);
-      uint64_t arg_int = strtoll(tokens[index1 + 1].ptr, &endptr, 10);
-
-      // returns true if successfully added
-      if (add_vertex(arg_int)) {
-	// append operation to log
-	if (add_to_log(ADD_NODE, arg_int, 0)) {
-          response = make_json_one("node_id", 7, arg_int);
-          respond(c, 200, strlen(response), response);
-          free(response);
-	} else respond(c, 507, 0, "");
-      } else {
-        // vertex already existed
-        respond(c, 204, 0, "");
-      }
-    } 
-    else if (!strncmp(hm->uri.p, "/api/v1/add_edge", hm->uri.len)) {
-      // body does not contain expected keys
-      if (find_a == 0 || find_b == 0) {
-        badRequest(c);
-        return;
-      }
+    // index of value
+    int index1 = argument_pos(tokens, arg_id);
+    uint64_t arg_int = strtoll(tokens[index1 + 1].ptr, &endptr, 10);
 
-      // index of values
-      int index1 = argument_pos(tokens, arg_a);
-      int index2 = argument_pos(tokens, arg_b);
-      uint64_t arg_a_int = strtoll(tokens[index1 + 1].ptr, &endptr, 10);
-      uint64_t arg_b_int = strtoll(tokens[index2 + 1].ptr, &endptr, 10);
-
-      // fix incase of things fucking up
-      switch (add_edge(arg_a_int, arg_b_int)) {
-        case 400:
-          respond(c, 400, 0, "");
-        case 204:
-          respond(c, 204, 0, "");
-        case 200:
-	  // append operation to log
-          if (add_to_log(ADD_EDGE, arg_a_int, arg_b_int)) {
-	    response = make_json_two("node_a_id", "node_b_id", 9, 9, arg_a_int, arg_b_int);
-	    respond(c, 200, strlen(response), response);
-            free(response);
-          } else respond(c, 507, 0, "");
-      }
-    } 
-    else if (!strncmp(hm->uri.p, "/api/v1/remove_node", hm->uri.len)) {
-      // body does not contain expected key
-      if (find_id == 0) {
-        badRequest(c);
-        return;
-      }
+    respond_node(c, cmd_remove_node(arg_int), arg_int);
+  } 
+  else if (!mg_vcmp(&hm->uri, "/api/v1/remove_edge")) {
+    // body does not contain expected keys
+    if (find_a == 0 || find_b == 0) {
+      badRequest(c);
+      return;
+    }
 
-      // index of value
-      int index1 = argument_pos(tokens, arg_id);
-      uint64_t arg_int = strtoll(tokens[index1 + 1].ptr, &endptr, 10);
-
-      // if node does not exist
-      if (remove_vertex(arg_int)) {
-	// append operation to log
-        if (add_to_log(REMOVE_NODE, arg_int, 0)) {
-	  response = make_json_one("node_id", 7, arg_int);
-          respond(c, 200, strlen(response), response);
-          free(response);
-	} else respond(c, 507, 0, "");
-      } else {
-        respond(c, 400, 0, "");
-      }
-    } 
-    else if (!strncmp(hm->uri.p, "/api/v1/remove_edge", hm->uri.len)) {
-      // body does not contain expected keys
-      if (find_a == 0 || find_b == 0) {
-        badRequest(c);
-        return;
-      }
+    // index of values
+    int index1 = argument_pos(tokens, arg_a);
+    int index2 = argument_pos(tokens, arg_b);
+    uint64_t arg_a_int = strtoll(tokens[index1 + 1].ptr, &endptr, 10);
+    uint64_t arg_b_int = strtoll(tokens[index2 + 1].ptr, &endptr, 10);
 
-      // index of values
-      int index1 = argument_pos(tokens, arg_a);
-      int index2 = argument_pos(tokens, arg_b);
-      uint64_t arg_a_int = strtoll(tokens[index1 + 1].ptr, &endptr, 10);
-      uint64_t arg_b_int = strtoll(tokens[index2 + 1].ptr, &endptr, 10);
-
-      // if edge does not exist
-      if (remove_edge(arg_a_int, arg_b_int)) {
-        // append operation to log
-        if (add_to_log(REMOVE_EDGE, arg_a_int, arg_b_int)) {
-	  response = make_json_two("node_a_id", "node_b_id", 9, 9, arg_a_int, arg_b_int);
-          respond(c, 200, strlen(response), response);
-          free(response);;
-	} else respond(c, 507, 0, "");
-      } else {
-        respond(c, 400, 0, "");
-      }
-    } 
-    else if(!strncmp(hm->uri.p, "/api/v1/get_node", hm->uri.len)) {
-      // body does not contain expected key
-      if(find_id == 0) {
-        badRequest(c);
-        return;
-      }
-      // index of value
-      int index1 = argument_pos(tokens, arg_id);
-      long long arg_int = strtoll(tokens[index1 + 1].ptr, &endptr, 10);
+    respond_edge(c, cmd_remove_edge(arg_a_int, arg_b_int), arg_a_int, arg_b_int);
+  } 
+  else if(!mg_vcmp(&hm->uri, "/api/v1/get_node")) {
+    // body does not contain expected key
+    if(find_id == 0) {
+      badRequest(c);
+      return;
+    }
+    // index of value
+    int index1 = argument_pos(tokens, arg_id);
+    uint64_t arg_int = strtoll(tokens[index1 + 1].ptr, &endptr, 10);
 
-      bool in_graph = get_node(arg_int);
+    bool in_graph;
+    cmd_get_node(arg_int, &in_graph);
+    response = make_json_one("in_graph", 8, in_graph);
+    respond(c, 200, strlen(response), response);
+    free(response);    
+  } 
+  else if(!mg_vcmp(&hm->uri, "/api/v1/get_edge")) {
+    // body does not contain expected keys
+    if(find_a == 0 || find_b == 0) {
+      badRequest(c);
+      return;
+    }
+
+    // index of values
+    int index1 = argument_pos(tokens, arg_a);
+    int index2 = argument_pos(tokens, arg_b);
+    uint64_t arg_a_int = strtoll(tokens[index1 + 1].ptr, &endptr, 10);
+    uint64_t arg_b_int = strtoll(tokens[index2 + 1].ptr, &endptr, 10);
+
+    bool in_graph;
+    if (cmd_get_edge(arg_a_int, arg_b_int, &in_graph) != 200) {
+      respond(c, 400, 0, "");
+    }
+    else {
       response = make_json_one("in_graph", 8, in_graph);
       respond(c, 200, strlen(response), response);
       free(response);    
-    } 
-    else if(!strncmp(hm->uri.p, "/api/v1/get_edge", hm->uri.len)) {
-      // body does not contain expected keys
-      if(find_a == 0 || find_b == 0) {
-        badRequest(c);
-        return;
-      }
+    }
+  } 
+  else if(!mg_vcmp(&hm->uri, "/api/v1/get_neighbors")) {
+    // body does not contain expected key
+    if(find_id == 0) {
+      badRequest(c);
+      return;
+    }
 
-      // index of values
-      int index1 = argument_pos(tokens, arg_a);
-      int index2 = argument_pos(tokens, arg_b);
-      long long arg_a_int = strtoll(tokens[index1 + 1].ptr, &endptr, 10);
-      long long arg_b_int = strtoll(tokens[index2 + 1].ptr, &endptr, 10);
+    // index of value
+    int index1 = argument_pos(tokens, arg_id);
+    uint64_t arg_int = strtoll(tokens[index1 + 1].ptr, &endptr, 10);
 
-      if (!get_node(arg_a_int) || !get_node(arg_b_int)){
-        respond(c, 400, 0, "");
-      }
-      else {
-        bool in_graph = get_edge(arg_a_int, arg_b_int);
-        response = make_json_one("in_graph", 8, in_graph);
-        respond(c, 200, strlen(response), response);
-        free(response);    
-      }
-    } 
-    else if(!strncmp(hm->uri.p, "/api/v1/get_neighbors", hm->uri.len)) {
-      // body does not contain expected key
-      if(find_id == 0) {
-        badRequest(c);
-        return;
-      }
+    int size;
+    uint64_t *neighbors;
+    if (cmd_get_neighbors(arg_int, &neighbors, &size) != 200) {
+      respond(c, 400, 0, "");
+    } else {
+      char* neighbor_array = format_neighbors(neighbors, size);
+      response = make_neighbor_response("node_id", "neighbors", 7, 9, arg_int, neighbor_array);
+      respond(c, 200, strlen(response), response);
+      free(response);
+      free(neighbor_array);
+      free(neighbors);
+    }
 
-      // index of value
-      int index1 = argument_pos(tokens, arg_id);
-      long long arg_int = strtoll(tokens[index1 + 1].ptr, &endptr, 10);
+  } 
+  else if(!mg_vcmp(&hm->uri, "/api/v1/shortest_path")) {
+    // body does not contain expected keys
+    if(find_a == 0 || find_b == 0) {
+      badRequest(c);
+      return;
+    }
 
-      if (!get_node(arg_int) ) {
-        respond(c, 400, 0, "");
-      } else {
-        int size;
-        uint64_t *neighbors = get_neighbors(arg_int, &size);
-        char* neighbor_array = format_neighbors(neighbors, size);
-        response = make_neighbor_response("node_id", "neighbors", 7, 9, arg_int, neighbor_array);
-        respond(c, 200, strlen(response), response);
-        free(response);
-        free(neighbors);
-      }
+    // index of values
+    int index1 = argument_pos(tokens, arg_a);
+    int index2 = argument_pos(tokens, arg_b);
+    uint64_t arg_a_int = strtoll(tokens[index1 + 1].ptr, &endptr, 10);
+    uint64_t arg_b_int = strtoll(tokens[index2 + 1].ptr, &endptr, 10);
+    
+    int path;
+    int code = cmd_shortest_path(arg_a_int, arg_b_int, &path);
+    if (code != 200) {
+      respond(c, code, 0, "");
+    } else {
+      response = make_json_one("distance", 8, path);
+      respond(c, 200, strlen(response), response);
+      free(response);
+    }
+  }
+  else if(!mg_vcmp(&hm->uri, "/api/v1/checkpoint")) {
+    // a started checkpoint is answered with its throughput once it is done
+    int code = cmd_checkpoint();
+    if (code == 200) conn(c)->report = true;
+    else respond(c, code, 0, "");
+  } 
+  else {
+    respond(c, 400, 0, "");
+  }
+}
 
-    } 
-    else if(!strncmp(hm->uri.p, "/api/v1/shortest_path", hm->uri.len)) {
-      // body does not contain expected keys
-      if(find_a == 0 || find_b == 0) {
-        badRequest(c);
-        return;
-      }
+// Event handler for request
+static void ev_handler(struct mg_connection *c, int ev, void *p) {
+  if (ev == MG_EV_HTTP_CHUNK) {
+    // imports are consumed chunk by chunk; other bodies are reassembled
+    if (is_import((struct http_message *) p)) import_chunk(c, (struct http_message *) p);
+  } else if (ev == MG_EV_CLOSE) {
+    if (c->user_data != NULL) conn_close(c);
+  } else if (ev == MG_EV_HTTP_REQUEST) {
+    struct http_message *hm = (struct http_message *) p;
+    size_t queued = c->send_mbuf.len;
+    uint64_t staged_before = staged_total;
+    uint64_t requests_before = checkpoint_requests;
+    uint64_t write = 0;
 
-      // index of values
-      int index1 = argument_pos(tokens, arg_a);
-      int index2 = argument_pos(tokens, arg_b);
-      long long arg_a_int = strtoll(tokens[index1 + 1].ptr, &endptr, 10);
-      long long arg_b_int = strtoll(tokens[index2 + 1].ptr, &endptr, 10);
-      
-      // if either node does not exist
-      if(!ret_vertex(arg_a_int) || !ret_vertex(arg_b_int)) {
-        respond(c, 400, 0, "");
-      } else {
-        int path = shortest_path(arg_a_int, arg_b_int);
-        if (path == -1) {
-          respond(c, 204, 0, "");
-        } else {
-          response = make_json_one("distance", 8, path);
-          respond(c, 200, strlen(response), response);
-          free(response);
-        }
-      }
+    if (is_import(hm)) {
+      // entries staged by earlier chunks may be in a write already issued
+      write = import_finish(c, hm);
+    } else {
+      int code = admit(c, is_expensive_uri(hm));
+      if (code != 0) respond(c, code, 0, "");
+      else handle_request(c, hm);
     }
-    else if(!strncmp(hm->uri.p, "/api/v1/checkpoint", hm->uri.len)) {
-      
-      int nsize = map.nsize;
-      int esize = map.esize;
-      if ((CHECKPOINT_HEADER + nsize*(CHECKPOINT_NODE) 
-        + esize*(CHECKPOINT_EDGE)) > CHECKPOINT_AREA){
-        respond(c, 507, 0, "");
+    admission.send_total += c->send_mbuf.len - queued;
+    if (staged_total != staged_before) write = log_writes_issued + 1;
+    hold_response(c, queued, write, checkpoint_requests != requests_before);
+  }
+}
 
-      }
-      else {
-        checkpoint_area *flat_graph= malloc(sizeof(struct checkpoint_area));
-    
+// Runs one binary request record and sends its response
+static void bin_request(struct mg_connection *c, log_entry *req) {
+  bin_response res;
+  uint64_t *neighbors = NULL;
+  int size = 0;
+  bool in_graph = false;
+  int distance = 0;
 
-        uint64_t *nodes = malloc(sizeof(uint64_t) * nsize);
-        mem_edge *edges = malloc(sizeof(struct mem_edge) * esize);
+  memset(&res, 0, sizeof(res));
+  switch (req->opcode) {
+    case ADD_NODE:
+      res.status = cmd_add_node(req->node_a_id);
+      break;
+    case ADD_EDGE:
+      res.status = cmd_add_edge(req->node_a_id, req->node_b_id);
+      break;
+    case REMOVE_NODE:
+      res.status = cmd_remove_node(req->node_a_id);
+      break;
+    case REMOVE_EDGE:
+      res.status = cmd_remove_edge(req->node_a_id, req->node_b_id);
+      break;
+    case GET_NODE:
+      res.status = cmd_get_node(req->node_a_id, &in_graph);
+      res.value = in_graph;
+      break;
+    case GET_EDGE:
+      res.status = cmd_get_edge(req->node_a_id, req->node_b_id, &in_graph);
+      res.value = in_graph;
+      break;
+    case GET_NEIGHBORS:
+      res.status = cmd_get_neighbors(req->node_a_id, &neighbors, &size);
+      if (res.status == 200) res.count = size;
+      break;
+    case SHORTEST_PATH:
+      res.status = cmd_shortest_path(req->node_a_id, req->node_b_id, &distance);
+      if (res.status == 200) res.value = distance;
+      break;
+    case CHECKPOINT:
+      res.status = cmd_checkpoint();
+      break;
+    default:
+      res.status = 400;
+  }
 
-        flat_graph->nsize = nsize;
-        flat_graph->esize = esize;
-        flat_graph->nodes = nodes;
-        flat_graph->edges = edges;
+  mg_send(c, &res, BIN_RESPONSE);
+  if (res.count) mg_send(c, neighbors, sizeof(uint64_t) * res.count);
+  free(neighbors);
+}
 
-        make_checkpoint(flat_graph);
-        docheckpoint(flat_graph);
-        checkpoint_area *loaded = get_checkpoint(fd);
-        respond(c, 200, 0, ""); 
-      } 
-    } 
-    else {
-      respond(c, 400, 0, "");
+// Event handler for the binary protocol; handles every complete frame received
+static void bin_handler(struct mg_connection *c, int ev, void *p) {
+  if (ev != MG_EV_RECV) return;
+  struct mbuf *io = &c->recv_mbuf;
+  size_t off = 0;
+  uint32_t length;
+  log_entry req;
+
+  // requests may be pipelined, so consume as many frames as are buffered
+  while (!conn(c)->close_after && io->len - off >= BIN_FRAME_HEADER) {
+    memcpy(&length, io->buf + off, BIN_FRAME_HEADER);
+    // a bad length is answered before its body arrives, which could be up to 4 GB, and ends the connection
+    if (length != BIN_REQUEST) {
+      size_t queued = c->send_mbuf.len;
+      bin_response res = { 400, 0, 0 };
+      mg_send(c, &res, BIN_RESPONSE);
+      conn(c)->close_after = true;
+      hold_response(c, queued, 0, false);
+      break;
+    }
+    if (io->len - off - BIN_FRAME_HEADER < length) break;
+
+    size_t queued = c->send_mbuf.len;
+    uint64_t staged_before = staged_total;
+    uint64_t requests_before = checkpoint_requests;
+    bin_response res = { 0, 0, 0 };
+    memcpy(&req, io->buf + off + BIN_FRAME_HEADER, BIN_REQUEST);
+    res.status = admit(c, req.opcode == GET_NEIGHBORS || req.opcode == SHORTEST_PATH);
+    if (res.status != 0) mg_send(c, &res, BIN_RESPONSE);
+    else bin_request(c, &req);
+    admission.send_total += c->send_mbuf.len - queued;
+    hold_response(c, queued, staged_total != staged_before ? log_writes_issued + 1 : 0,
+        checkpoint_requests != requests_before);
+    off += BIN_FRAME_HEADER + length;
+  }
+  // nothing more is read from a connection that is closing
+  mbuf_remove(io, conn(c)->close_after ? io->len : off);
+}
+
+// Event handler for the log writer's completion socket or eventfd; the main loop collects what finished
+static void writer_handler(struct mg_connection *c, int ev, void *p) {
+  if (ev == MG_EV_RECV) mbuf_remove(&c->recv_mbuf, c->recv_mbuf.len);
+}
+
+// Prints usage message
+static void usage() {
+  fprintf(stderr, "Usage: ./cs426_graph_server [-f] [-b <binport>] [-u <socket>] [--max-expensive <n>]\n"
+                  "       [--max-conn-send <bytes>] [--max-total-send <bytes>] [--commit-window <us>]\n"
+                  "       [--durability none|batch|strict] [--sync-interval <us>] [--sync-bytes <bytes>]\n"
+                  "       [--log-writer sync|uring|thread] [--replay sequential|compact]\n"
+                  "       [--checkpoint-at <ratio>] [--checkpoint-mode copy|fork] [--checkpoint-deltas <n>]\n"
+                  "       <port> <devfile>\n");
+}
+
+// Listens for HTTP requests on a unix domain stream socket at path, returns NULL on failure
+static struct mg_connection* bind_unix(struct mg_mgr *mgr, const char *path) {
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path)) return NULL;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  // remove a socket left behind by an earlier run, but nothing else that is there
+  struct stat st;
+  if (lstat(path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "%s exists and is not a socket\n", path);
+      return NULL;
     }
+    unlink(path);
   }
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock == -1) return NULL;
+  if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) || listen(sock, SOMAXCONN)) {
+    close(sock);
+    return NULL;
+  }
+
+  // mongoose accepts on it like on its own listeners
+  struct mg_connection *c = mg_add_sock(mgr, sock, ev_handler);
+  if (c == NULL) {
+    close(sock);
+    return NULL;
+  }
+  c->flags |= MG_F_LISTENING;
+  mg_set_protocol_http_websocket(c);
+  return c;
 }
 
 int main(int argc, char** argv) {
 
   bool format = false; 	// format flag specified?
- 
+  const char *s_bin_port = NULL;	// binary protocol port, if any
+  const char *unix_path = NULL;	// unix domain socket path, if any
+  int writer = LOG_WRITER_SYNC;	// log writer asked for
+  int opt;
+
+  static struct option long_options[] = {
+    { "format", no_argument, NULL, 'f' },
+    { "binary-port", required_argument, NULL, 'b' },
+    { "unix-socket", required_argument, NULL, 'u' },
+    { "max-expensive", required_argument, NULL, 'E' },
+    { "max-conn-send", required_argument, NULL, 'C' },
+    { "max-total-send", required_argument, NULL, 'T' },
+    { "commit-window", required_argument, NULL, 'W' },
+    { "durability", required_argument, NULL, 'D' },
+    { "sync-interval", required_argument, NULL, 'I' },
+    { "sync-bytes", required_argument, NULL, 'B' },
+    { "log-writer", required_argument, NULL, 'L' },
+    { "replay", required_argument, NULL, 'R' },
+    { "checkpoint-at", required_argument, NULL, 'K' },
+    { "checkpoint-mode", required_argument, NULL, 'M' },
+    { "checkpoint-deltas", required_argument, NULL, 'N' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  while ((opt = getopt_long(argc, argv, "fb:u:", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'f':
+        format = true;
+        break;
+      case 'b':
+        s_bin_port = optarg;
+        break;
+      case 'u':
+        unix_path = optarg;
+        break;
+      case 'E':
+        admission.max_expensive = atoi(optarg);
+        break;
+      case 'C':
+        admission.max_conn_send = strtoull(optarg, NULL, 10);
+        break;
+      case 'T':
+        admission.max_total_send = strtoull(optarg, NULL, 10);
+        break;
+      case 'W':
+        commit_window = strtoull(optarg, NULL, 10) / 1e6;
+        break;
+      case 'D':
+        if (!strcmp(optarg, "none")) durability = DURABILITY_NONE;
+        else if (!strcmp(optarg, "batch")) durability = DURABILITY_BATCH;
+        else if (!strcmp(optarg, "strict")) durability = DURABILITY_STRICT;
+        else {
+          usage();
+          return 1;
+        }
+        break;
+      case 'I':
+        sync_interval = strtoull(optarg, NULL, 10) / 1e6;
+        break;
+      case 'B':
+        sync_bytes = strtoull(optarg, NULL, 10);
+        break;
+      case 'L':
+        if (!strcmp(optarg, "sync")) writer = LOG_WRITER_SYNC;
+        else if (!strcmp(optarg, "uring")) writer = LOG_WRITER_URING;
+        else if (!strcmp(optarg, "thread")) writer = LOG_WRITER_THREAD;
+        else {
+          usage();
+          return 1;
+        }
+        break;
+      case 'R':
+        if (!strcmp(optarg, "sequential")) replay_mode = REPLAY_SEQUENTIAL;
+        else if (!strcmp(optarg, "compact")) replay_mode = REPLAY_COMPACT;
+        else {
+          usage();
+          return 1;
+        }
+        break;
+      case 'K':
+        checkpoint_at = strtod(optarg, NULL);
+        if (checkpoint_at < 0 || checkpoint_at > 1) {
+          usage();
+          return 1;
+        }
+        break;
+      case 'M':
+        if (!strcmp(optarg, "copy")) checkpoint_mode = CHECKPOINT_COPY;
+        else if (!strcmp(optarg, "fork")) checkpoint_mode = CHECKPOINT_FORK;
+        else {
+          usage();
+          return 1;
+        }
+        break;
+      case 'N':
+        checkpoint_deltas_max = atoi(optarg);
+        if (checkpoint_deltas_max < 0) {
+          usage();
+          return 1;
+        }
+        break;
+      default:
+        usage();
+        return 1;
+    }
+  }
+
   // ensure correct number of arguments
-  if (argc != 3 && argc != 4) {
-    fprintf(stderr, "Usage: ./cs426_graph_server [-f] <port> <devfile>\n");
+  if (argc - optind != 2) {
+    usage();
     return 1;
-  } else if (argc == 4) {
-    if (strcmp(argv[1], "-f")) {
-      fprintf(stderr, "Usage: ./cs426_graph_server [-f] <port> <devfile>\n");
-      return 1;
-    } else {
-      format = true;
-    }
   }
 
-  const char *s_http_port = argv[(format? 2 : 1)];
-  const char *devfile = argv[(format? 3 : 2)];
+  const char *s_http_port = argv[optind];
+  const char *devfile = argv[optind + 1];
 
   fd = open(devfile, O_RDWR);
-  if (fd == -1) {
+  if (fd == -1 || !open_log(devfile)) {
     fprintf(stderr, "Unable to open %s. Abort.\n", devfile);
     return 1;
   }
@@ -380,10 +1072,25 @@ int main(int argc, char** argv) {
 
   mg_mgr_init(&mgr, NULL);
   c = mg_bind(&mgr, s_http_port, ev_handler);
+  if (c == NULL) {
+    fprintf(stderr, "Unable to bind to port %s. Abort.\n", s_http_port);
+    return 1;
+  }
   mg_set_protocol_http_websocket(c);
 
+  if (s_bin_port != NULL && mg_bind(&mgr, s_bin_port, bin_handler) == NULL) {
+    fprintf(stderr, "Unable to bind binary protocol to port %s. Abort.\n", s_bin_port);
+    return 1;
+  }
+
+  if (unix_path != NULL && bind_unix(&mgr, unix_path) == NULL) {
+    fprintf(stderr, "Unable to listen on unix socket %s. Abort.\n", unix_path);
+    return 1;
+  }
+
   map.nsize = 0;
   map.esize = 0;
+  map.capacity = SIZE;
   map.table = malloc(SIZE * sizeof(vertex*));
   for (int i = 0; i < SIZE; i++) (map.table)[i] = NULL;
 
@@ -401,14 +1108,51 @@ int main(int argc, char** argv) {
         fprintf(stderr, "Normal startup failed. Abort\n");
         return 1;
       } else {
-        checkpoint_area *loaded = get_checkpoint(fd);
-        if (loaded != NULL) buildmap(loaded);
+        if (!load_checkpoint(fd)) {
+          fprintf(stderr, "Unable to load checkpoint. Abort\n");
+          return 1;
+        }
 	      tail = get_tail();
+        // a checkpoint moves the replayed v1 device to the v2 layout
+        if (layout == LAYOUT_V1) {
+          if (!docheckpoint()) {
+            fprintf(stderr, "Failed to migrate v1 layout. Abort\n");
+            return 1;
+          }
+          fprintf(stderr, "Migrated v1 layout to v2\n");
+        }
       }
   }
 
+  if (!log_writer_start(writer)) {
+    fprintf(stderr, "Log writer unavailable, writing the log synchronously\n");
+    log_writer_start(LOG_WRITER_SYNC);
+  }
+  // completions of the writer thread or io_uring wake the poll
+  if (log_writer_notify_fd() != -1 && mg_add_sock(&mgr, log_writer_notify_fd(), writer_handler) == NULL) {
+    fprintf(stderr, "Unable to watch the log writer. Abort.\n");
+    return 1;
+  }
+
     for (;;) {
-      mg_mgr_poll(&mgr, 1000);
+      admission_reset(&mgr);
+      mg_mgr_poll(&mgr, poll_timeout(mg_time()));
+
+      // group commit: everything staged during the window goes out in one write
+      double now = mg_time();
+      if (n_staged == 0) staged_since = 0;
+      else if (staged_since == 0) staged_since = now;
+      if (commit_due(now)) {
+        commit_log();
+        staged_since = 0;
+      }
+      log_writer_reap(false);
+      finish_checkpoint(false);
+      if (n_pending > 0) release_responses();
+      sync_log_if_due(now);
+
+      // checkpoint in the background well before the log fills up
+      if (checkpoint_due()) cmd_checkpoint();
     }
     mg_mgr_free(&mgr);
 